@@ -0,0 +1,449 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Microbenchmarks for the bitmap, kernel, codec and partition I/O paths.
+ * Each case runs a few times to warm up, then is timed repeatedly, and
+ * the median and 99th percentile go to stdout and to a JSON file.
+ */
+
+#include "arena.h"
+#include "kernel.h"
+#include "scan.h"
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_BM_BITS (1u << 24)
+#define BENCH_GROUP_BITS 32768
+#define BENCH_BUF_SIZE POOL_BUF_SIZE
+// Smaller, the high levels on low entropy data take seconds per MiB
+#define BENCH_CODEC_SIZE (256 * 1024)
+#define BENCH_FILE_MIB 64
+
+typedef void (*bench_fn_t)(void);
+
+static uint32_t reps = 20;
+static uint32_t warmup = 3;
+static char* json_fn = "microbench.json";
+static char* file_dir = ".";
+static FILE* json;
+static uint32_t results;
+
+static uint8_t* data;
+static bm_word_t* src_bm;
+static const kern_t* bench_kern;
+static volatile uint64_t sink;
+
+// TSC ticks, which are reference cycles on current x86 parts
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench(char* name, uint64_t bytes, bench_fn_t fn)
+{
+    uint64_t* ns = common_malloc(reps * sizeof(uint64_t), "timings");
+    uint64_t* cyc = common_malloc(reps * sizeof(uint64_t), "timings");
+
+    for (uint32_t i = 0; i < warmup; i++)
+        fn();
+    for (uint32_t i = 0; i < reps; i++)
+    {
+        uint64_t c = cycles();
+        uint64_t t = clock_ns(CLOCK_MONOTONIC);
+        fn();
+        ns[i] = clock_ns(CLOCK_MONOTONIC) - t;
+        cyc[i] = cycles() - c;
+    }
+    qsort(ns, reps, sizeof(uint64_t), cmp_u64);
+    qsort(cyc, reps, sizeof(uint64_t), cmp_u64);
+
+    uint64_t median = ns[reps / 2];
+    uint64_t p99 = ns[(reps * 99 + 99) / 100 - 1];
+    double mbs = median ? bytes * 1e3 / median : 0;
+    double cpb = (double)cyc[reps / 2] / bytes;
+
+    print("%-28s %12.3f %12.3f %10.1f %8.3f\n", name, median / 1e3, p99 / 1e3,
+        mbs, cpb);
+    fprintf(json,
+        "%s\n    {\"name\": \"%s\", \"bytes\": %llu, \"median_ns\": %llu, "
+        "\"p99_ns\": %llu, \"mb_per_s\": %.1f, \"cycles_per_byte\": %.4f}",
+        results++ ? "," : "", name, (unsigned long long)bytes,
+        (unsigned long long)median, (unsigned long long)p99, mbs, cpb);
+
+    free(ns);
+    free(cyc);
+}
+
+// Bytes with the given bits of entropy each, 0 is all zeros
+static void fill(uint8_t* p, uint64_t size, uint32_t bits)
+{
+    for (uint64_t i = 0; i < size; i++)
+        p[i] = lrand48() & ((1u << bits) - 1);
+}
+
+static void bm_get(void)
+{
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < BENCH_BM_BITS; i++)
+        n += get_bm_bit(part_bm, i);
+    sink += n;
+}
+
+static void bm_set(void)
+{
+    for (uint64_t i = 0; i < BENCH_BM_BITS; i++)
+        set_bm_bit(part_bm, i);
+}
+
+static void bm_merge(void)
+{
+    for (uint32_t g = 0; g < groups; g++)
+        sink += copy_group_to_global_bm(g, src_bm);
+}
+
+static void bm_count(void)
+{
+    sink += part_used_blocks();
+}
+
+static void bm_runs(void)
+{
+    uint64_t block = 0;
+    uint32_t n;
+    while ((n = part_next_run(&block)) != 0)
+        block += n;
+    sink += block;
+}
+
+static void bench_bitmaps(void)
+{
+    char name[64];
+
+    block_count = BENCH_BM_BITS;
+    block_size = 4096;
+    cluster_bits = 0;
+    cluster_count = BENCH_BM_BITS;
+    clusters_per_group = BENCH_GROUP_BITS;
+    groups = BENCH_BM_BITS / BENCH_GROUP_BITS;
+    io_size = POOL_BUF_SIZE;
+    kern_init();
+
+    part_bm = arena_alloc(BENCH_BM_BITS / 8, "bitmap");
+    src_bm = arena_alloc(BENCH_GROUP_BITS / 8, "group bitmap");
+    fill((uint8_t*)src_bm, BENCH_GROUP_BITS / 8, 8);
+
+    bench("bitmap_set", BENCH_BM_BITS / 8, bm_set);
+    bench("bitmap_get", BENCH_BM_BITS / 8, bm_get);
+    for (first_block = 0; first_block < 2; first_block++)
+    {
+        sprintf(name, "bitmap_merge_first%d", first_block);
+        bench(name, BENCH_BM_BITS / 8, bm_merge);
+    }
+    first_block = 0;
+
+    // Alternating runs of up to 256 blocks in use and free
+    bzero(part_bm, BENCH_BM_BITS / 8);
+    for (uint64_t b = 0; b < BENCH_BM_BITS;)
+    {
+        uint64_t n = 1 + lrand48() % 256;
+        for (uint64_t i = b; (i < b + n) && (i < BENCH_BM_BITS); i++)
+            set_bm_bit(part_bm, i);
+        b += n + 1 + lrand48() % 256;
+    }
+    bench("bitmap_count", BENCH_BM_BITS / 8, bm_count);
+    bench("bitmap_runs", BENCH_BM_BITS / 8, bm_runs);
+
+    arena_free(src_bm);
+    arena_free(part_bm);
+}
+
+static void kern_zero(void)
+{
+    uint32_t n = 0;
+    for (uint32_t off = 0; off < BENCH_BUF_SIZE; off += block_size)
+        n += bench_kern->zero(data + off);
+    sink += n;
+}
+
+static void kern_hash(void)
+{
+    uint64_t h = 0;
+    for (uint32_t off = 0; off < BENCH_BUF_SIZE; off += block_size)
+        h = bench_kern->hash(data + off, h);
+    sink += h;
+}
+
+static void bench_kernels(void)
+{
+    const kern_t* table;
+    uint32_t cnt = kern_variants(&table);
+    char name[64];
+    char size[16];
+
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        bench_kern = &table[i];
+        block_size = bench_kern->block_size ? bench_kern->block_size : 4096;
+
+        if (bench_kern->block_size)
+            sprintf(size, "%dk", block_size >> 10);
+        else
+            strcpy(size, "any");
+
+        // Zero detection never exits early, zeros are its normal input
+        bzero(data, BENCH_BUF_SIZE);
+        sprintf(name, "zero_%s_%s", bench_kern->isa, size);
+        bench(name, BENCH_BUF_SIZE, kern_zero);
+
+        fill(data, BENCH_BUF_SIZE, 8);
+        sprintf(name, "hash_%s_%s", bench_kern->isa, size);
+        bench(name, BENCH_BUF_SIZE, kern_hash);
+    }
+}
+
+static uint8_t* packed;
+static uLongf packed_size;
+static uint8_t* unpacked;
+
+static void codec_deflate(void)
+{
+    dump_write(data, BENCH_CODEC_SIZE, "benchmark");
+}
+
+static void codec_inflate(void)
+{
+    uLongf size = BENCH_CODEC_SIZE;
+    if (uncompress(unpacked, &size, packed, packed_size) != Z_OK)
+        error("Can't decompress benchmark data\n");
+}
+
+static void bench_codecs(void)
+{
+    static const uint32_t entropy[] = {0, 1, 4, 8};
+    char name[64];
+
+    int null_fh = open("/dev/null", O_WRONLY);
+    if (null_fh < 0)
+        error("Can't open /dev/null\n%s\n", strerror(errno));
+    uLongf bound = compressBound(BENCH_CODEC_SIZE);
+    packed = common_malloc(bound, "benchmark");
+    unpacked = common_malloc(BENCH_CODEC_SIZE, "benchmark");
+
+    for (uint32_t e = 0; e < sizeof(entropy) / sizeof(entropy[0]); e++)
+    {
+        fill(data, BENCH_CODEC_SIZE, entropy[e]);
+        for (uint32_t lvl = 0; lvl <= 9; lvl++)
+        {
+            // gzclose closes the descriptor, so stdout is redirected again
+            if (dup2(null_fh, STDOUT_FILENO) < 0)
+                error("Can't redirect stdout\n%s\n", strerror(errno));
+            dump_open(WRITE, lvl);
+            sprintf(name, "deflate_l%d_e%d", lvl, entropy[e]);
+            bench(name, BENCH_CODEC_SIZE, codec_deflate);
+            dump_close();
+
+            packed_size = bound;
+            if (compress2(packed, &packed_size, data, BENCH_CODEC_SIZE, lvl) !=
+                Z_OK)
+                error("Can't compress benchmark data\n");
+            sprintf(name, "inflate_l%d_e%d", lvl, entropy[e]);
+            bench(name, BENCH_CODEC_SIZE, codec_inflate);
+        }
+    }
+
+    free(unpacked);
+    free(packed);
+    close(null_fh);
+}
+
+static uint64_t io_block;
+
+static void io_write(void)
+{
+    uint32_t n = BENCH_BUF_SIZE / block_size;
+    part_write_blocks(io_block, n, "benchmark");
+    io_block = (io_block + n) % block_count;
+}
+
+static void io_read(void)
+{
+    uint32_t n = BENCH_BUF_SIZE / block_size;
+    part_read_blocks(io_block, n, "benchmark");
+    io_block = (io_block + n) % block_count;
+}
+
+// Create the file that stands in for a partition, in dir
+static char* bench_file(char* dir)
+{
+    char* fn = common_malloc(strlen(dir) + 32, "benchmark");
+    sprintf(fn, "%s/microbench.img", dir);
+    int fh = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if ((fh < 0) || ftruncate(fh, (uint64_t)BENCH_FILE_MIB << 20))
+        error("Can't create %s\n%s\n", fn, strerror(errno));
+    close(fh);
+    return fn;
+}
+
+static void bench_part(char* target)
+{
+    char name[64];
+
+    block_size = 4096;
+    block_count = ((uint64_t)BENCH_FILE_MIB << 20) / block_size;
+    blk = data;
+    fill(blk, BENCH_BUF_SIZE, 8);
+
+    part_open(WRITE, 0);
+    io_block = 0;
+    sprintf(name, "write_%s", target);
+    bench(name, BENCH_BUF_SIZE, io_write);
+    part_sync();
+    part_close();
+
+    // Drop the page cache copy so a disk backed file is really read
+    part_open(READ, 1);
+    posix_fadvise(part_fh, 0, 0, POSIX_FADV_DONTNEED);
+    io_block = 0;
+    sprintf(name, "read_%s", target);
+    bench(name, BENCH_BUF_SIZE, io_read);
+    part_close();
+}
+
+static void bench_io(char* target, char* dir)
+{
+    part_fn = bench_file(dir);
+    bench_part(target);
+    unlink(part_fn);
+    free(part_fn);
+    part_fn = NULL;
+}
+
+/*
+ * A block device in front of the same file, for the block layer's share.
+ * Skipped when losetup is missing or not permitted, as it is for users.
+ */
+static void bench_loop(char* dir)
+{
+    char* fn = bench_file(dir);
+    char* cmd = common_malloc(strlen(fn) + 64, "benchmark");
+    char dev[64] = "";
+
+    sprintf(cmd, "losetup -f --show %s 2>/dev/null", fn);
+    FILE* p = popen(cmd, "r");
+    if (p)
+    {
+        if (fgets(dev, sizeof(dev), p) == NULL)
+            dev[0] = 0;
+        dev[strcspn(dev, "\n")] = 0;
+        if (pclose(p))
+            dev[0] = 0;
+    }
+
+    if (dev[0])
+    {
+        part_fn = dev;
+        bench_part("loop");
+        part_fn = NULL;
+        sprintf(cmd, "losetup -d %s", dev);
+        if (system(cmd))
+            print("Can't detach %s\n", dev);
+    }
+    else
+        print("%-28s skipped, no loop device\n", "loop");
+
+    unlink(fn);
+    free(cmd);
+    free(fn);
+}
+
+static void help(char* prog)
+{
+    print("Usage: %s [-r repetitions] [-w warmups] [-o json_path] "
+          "[-d file_dir]\n",
+        prog);
+    exit(0);
+}
+
+int main(int ac, char* av[])
+{
+    int c;
+
+    while ((c = getopt(ac, av, "r:w:o:d:")) != -1)
+        switch (c)
+        {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'o':
+            json_fn = optarg;
+            break;
+        case 'd':
+            file_dir = optarg;
+            break;
+        default:
+            help(av[0]);
+        }
+    if ((reps == 0) || (optind != ac))
+        help(av[0]);
+
+    json = fopen(json_fn, "w");
+    if (json == NULL)
+        error("Can't create %s\n%s\n", json_fn, strerror(errno));
+
+    srand48(1);
+    pool_init(POOL_BUFS);
+    data = pool_get();
+    block_size = 4096;
+    kern_init();
+
+    fprintf(json, "{\n  \"isa\": \"%s\",\n  \"reps\": %d,\n  \"warmup\": %d,\n"
+                  "  \"results\": [", kern.isa, reps, warmup);
+    print("%-28s %12s %12s %10s %8s\n", "", "median us", "p99 us", "MB/s",
+        "cyc/B");
+
+    bench_bitmaps();
+    bench_kernels();
+    bench_codecs();
+    bench_io("tmpfs", "/dev/shm");
+    bench_io("file", file_dir);
+    bench_loop(file_dir);
+
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    pool_put(data);
+
+    print("Results written to %s\n", json_fn);
+    return 0;
+}
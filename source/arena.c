@@ -0,0 +1,213 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define POOL_NIL 0xffffffffu
+
+uint8_t huge_flag;
+uint8_t mlock_flag;
+
+typedef struct arena_map_s
+{
+    void* p;
+    uint64_t size;
+} arena_map_t;
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_map_t maps[ARENA_ALLOCS_MAX];
+static uint64_t arena_bytes;
+static uint64_t arena_peak;
+static uint8_t mlock_warned;
+
+static uint8_t* pool;
+static uint32_t* pool_next;
+static uint32_t pool_count;
+static uint64_t pool_head; // tag << 32 | index, the tag defeats ABA
+static uint32_t pool_used;
+static uint32_t pool_peak;
+static uint32_t pool_overflow;
+
+/*
+ * Map anonymous memory, from the huge page reserve if asked for and
+ * available, otherwise with a transparent huge page hint. The size is
+ * rounded up to the page size used.
+ */
+static void* arena_map(uint64_t* size, char* emsg)
+{
+    void* p = MAP_FAILED;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+
+#ifdef MAP_HUGETLB
+    if (huge_flag)
+    {
+        uint64_t s = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1ull);
+        p = mmap(NULL, s, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            *size = s;
+    }
+#endif
+    if (p == MAP_FAILED)
+    {
+        *size = (*size + page - 1) & ~(page - 1);
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            error("Can't allocate memory for %s\n%s\n", emsg, strerror(errno));
+#ifdef MADV_HUGEPAGE
+        if (huge_flag)
+            madvise(p, *size, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (mlock_flag && mlock(p, *size) && !mlock_warned)
+    {
+        print("WARNING: can't lock memory\n%s\n", strerror(errno));
+        mlock_warned = 1;
+    }
+
+    arena_bytes += *size;
+    if (arena_bytes > arena_peak)
+        arena_peak = arena_bytes;
+    return p;
+}
+
+// Large, long lived buffers. Memory is page aligned and zeroed.
+void* arena_alloc(uint64_t size, char* emsg)
+{
+    assert(size);
+
+    pthread_mutex_lock(&arena_lock);
+    uint32_t i;
+    for (i = 0; i < ARENA_ALLOCS_MAX; i++)
+        if (maps[i].p == NULL)
+            break;
+    if (i == ARENA_ALLOCS_MAX)
+        error("Can't allocate memory for %s\nToo many buffers\n", emsg);
+
+    maps[i].size = size;
+    maps[i].p = arena_map(&maps[i].size, emsg);
+    void* p = maps[i].p;
+    pthread_mutex_unlock(&arena_lock);
+    return p;
+}
+
+void arena_free(void* p)
+{
+    assert(p);
+
+    pthread_mutex_lock(&arena_lock);
+    for (uint32_t i = 0; i < ARENA_ALLOCS_MAX; i++)
+        if (maps[i].p == p)
+        {
+            munmap(p, maps[i].size);
+            arena_bytes -= maps[i].size;
+            maps[i].p = NULL;
+            pthread_mutex_unlock(&arena_lock);
+            return;
+        }
+    assert(0);
+}
+
+/*
+ * The I/O buffer pool is reserved up front in one mapping and handed out
+ * through a lock free stack of buffer indices. pool_next entries are read
+ * by one thread while another may be pushing, so they are atomic too.
+ * Once the pool is empty, buffers come from the arena one at a time.
+ */
+void pool_init(uint32_t count)
+{
+    assert(count);
+    assert(pool == NULL);
+
+    pool = arena_alloc((uint64_t)count * POOL_BUF_SIZE, "buffer pool");
+    pool_next = common_malloc(count * sizeof(uint32_t), "buffer pool");
+    for (uint32_t i = 0; i < count; i++)
+        __atomic_store_n(
+            &pool_next[i], (i + 1 < count) ? i + 1 : POOL_NIL, __ATOMIC_RELAXED);
+    pool_count = count;
+    pool_head = 0;
+}
+
+void* pool_get(void)
+{
+    assert(pool);
+
+    uint64_t old = __atomic_load_n(&pool_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    uint8_t* p = NULL;
+    do
+    {
+        uint32_t i = (uint32_t)old;
+        if (i == POOL_NIL)
+        {
+            __atomic_add_fetch(&pool_overflow, 1, __ATOMIC_RELAXED);
+            p = arena_alloc(POOL_BUF_SIZE, "I/O buffer");
+            break;
+        }
+        new = (((old >> 32) + 1) << 32) |
+              __atomic_load_n(&pool_next[i], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool_head, &old, new, 1,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (p == NULL)
+        p = pool + (uint64_t)(uint32_t)old * POOL_BUF_SIZE;
+
+    uint32_t used = __atomic_add_fetch(&pool_used, 1, __ATOMIC_RELAXED);
+    uint32_t peak = __atomic_load_n(&pool_peak, __ATOMIC_RELAXED);
+    while ((used > peak) && !__atomic_compare_exchange_n(&pool_peak, &peak,
+                                used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return p;
+}
+
+void pool_put(void* p)
+{
+    assert(pool);
+
+    __atomic_sub_fetch(&pool_used, 1, __ATOMIC_RELAXED);
+    if (((uint8_t*)p < pool) ||
+        ((uint8_t*)p >= pool + (uint64_t)pool_count * POOL_BUF_SIZE))
+    {
+        arena_free(p);
+        return;
+    }
+
+    uint32_t i = ((uint8_t*)p - pool) / POOL_BUF_SIZE;
+    uint64_t old = __atomic_load_n(&pool_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    do
+    {
+        __atomic_store_n(&pool_next[i], (uint32_t)old, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | i;
+    } while (!__atomic_compare_exchange_n(&pool_head, &old, new, 1,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+void arena_report(void)
+{
+    print("Peak memory %'lld bytes, %'d of %'d I/O buffers", arena_peak,
+        pool_peak, pool_count);
+    if (pool_overflow)
+        print(", %'d allocated past the pool", pool_overflow);
+    print("\n");
+}
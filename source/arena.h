@@ -0,0 +1,41 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+// Fixed size I/O buffers, page aligned so they suit O_DIRECT
+#define POOL_BUF_SIZE (1024 * 1024)
+// Pool buffers needed besides the stripe chunks
+#define POOL_BUFS 2
+
+#define ARENA_ALLOCS_MAX 32
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+extern uint8_t huge_flag;
+extern uint8_t mlock_flag;
+
+void* arena_alloc(uint64_t size, char* emsg);
+void arena_free(void* p);
+
+void pool_init(uint32_t count);
+void* pool_get(void);
+void pool_put(void* p);
+
+void arena_report(void);
@@ -0,0 +1,109 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "checkpoint.h"
+
+char* ckpt_fn;
+uint8_t resume_flag;
+
+// Checkpoint files are little-endian like the backup itself
+static void ckpt_swap(ext4_ckpt_t* c)
+{
+    c->blocks = le64_to_cpu(c->blocks);
+    c->next_block = le64_to_cpu(c->next_block);
+    c->block_cnt = le64_to_cpu(c->block_cnt);
+    c->stream_bytes = le64_to_cpu(c->stream_bytes);
+    c->dump_bytes = le64_to_cpu(c->dump_bytes);
+    c->bm_crc = le32_to_cpu(c->bm_crc);
+    c->block_size = le32_to_cpu(c->block_size);
+    c->magic = le32_to_cpu(c->magic);
+}
+
+static void ckpt_load(uint32_t magic, ext4_ckpt_t* c)
+{
+    int fh = open(ckpt_fn, O_RDONLY);
+    if (fh < 0)
+        error("Can't open checkpoint %s\n%s\n", ckpt_fn, strerror(errno));
+    if (read(fh, c, sizeof(*c)) != sizeof(*c))
+        error("Can't read checkpoint %s\n", ckpt_fn);
+    close(fh);
+    ckpt_swap(c);
+    if ((c->magic != CKPT_BACKUP_MAGIC) && (c->magic != CKPT_RESTORE_MAGIC))
+        error("Not checkpoint file\n");
+    if (c->magic != magic)
+        error("Checkpoint is for a %s\n",
+            (c->magic == CKPT_BACKUP_MAGIC) ? "backup" : "restore");
+}
+
+void ckpt_init(uint32_t magic, uint32_t bm_bytes, ext4_ckpt_t* ckpt)
+{
+    assert((magic == CKPT_BACKUP_MAGIC) || (magic == CKPT_RESTORE_MAGIC));
+    assert(ckpt);
+    assert(part_bm);
+
+    bzero(ckpt, sizeof(*ckpt));
+    ckpt->blocks = block_count;
+    ckpt->block_size = block_size;
+    ckpt->bm_crc = crc32(crc32(0, NULL, 0), (uint8_t*)part_bm, bm_bytes);
+    ckpt->magic = magic;
+    memcpy((char*)&ckpt->version, BACKUP_E4_VERSION, 3);
+
+    if (!resume_flag)
+        return;
+
+    ext4_ckpt_t c;
+    ckpt_load(magic, &c);
+    if ((c.blocks != ckpt->blocks) || (c.block_size != ckpt->block_size))
+        error("Checkpoint is for a different partition\n");
+    if (c.bm_crc != ckpt->bm_crc)
+        error("Partition bitmap changed since checkpoint\n");
+    *ckpt = c;
+
+    print("Resuming at block %'lld, %'lld blocks done\n", ckpt->next_block,
+        ckpt->block_cnt);
+}
+
+void ckpt_save(ext4_ckpt_t* ckpt)
+{
+    assert(ckpt);
+    assert(ckpt_fn);
+
+    ext4_ckpt_t c = *ckpt;
+    ckpt_swap(&c);
+
+    // Write aside and rename so a crash never leaves a torn checkpoint
+    char* tmp = common_malloc(strlen(ckpt_fn) + 5, "checkpoint");
+    sprintf(tmp, "%s.tmp", ckpt_fn);
+    int fh = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fh < 0)
+        error("Can't create checkpoint %s\n%s\n", tmp, strerror(errno));
+    if ((write(fh, &c, sizeof(c)) != sizeof(c)) || fsync(fh))
+        error("Can't write checkpoint %s\n%s\n", tmp, strerror(errno));
+    close(fh);
+    if (rename(tmp, ckpt_fn))
+        error("Can't rename checkpoint %s\n%s\n", tmp, strerror(errno));
+    free(tmp);
+}
+
+void ckpt_done(void)
+{
+    assert(ckpt_fn);
+
+    if (unlink(ckpt_fn) && (errno != ENOENT))
+        print("WARNING: can't remove checkpoint %s\n", ckpt_fn);
+}
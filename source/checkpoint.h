@@ -0,0 +1,53 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+#define CKPT_BACKUP_MAGIC 0xe4bce4bc
+#define CKPT_RESTORE_MAGIC 0xe4bee4be
+#define CKPT_BYTES (256 * 1024 * 1024)
+
+/*
+ * Checkpoint sidecar file. Rewritten every CKPT_BYTES of data, after the
+ * backup stream or the partition has been synced. Blocks below next_block
+ * are safely stored. dump_bytes and stream_bytes are the compressed and
+ * uncompressed offsets of the last gzip member boundary of the backup at or
+ * before the checkpoint. Backups end a member at each checkpoint, restores
+ * use them to jump over finished data.
+ */
+typedef struct ext4_ckpt_s
+{
+    uint64_t blocks;
+    uint64_t next_block;
+    uint64_t block_cnt;
+    uint64_t stream_bytes;
+    int64_t dump_bytes;
+    uint32_t bm_crc;
+    uint32_t block_size;
+    uint32_t magic; /* backup or restore */
+    uint32_t version;
+} ext4_ckpt_t;
+
+extern char* ckpt_fn;
+extern uint8_t resume_flag;
+
+void ckpt_init(uint32_t magic, uint32_t bm_bytes, ext4_ckpt_t* ckpt);
+void ckpt_save(ext4_ckpt_t* ckpt);
+void ckpt_done(void);
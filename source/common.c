@@ -17,7 +17,14 @@ along with this program; If not, see <http://www.gnu.org/licenses/>.
 */
 
 
+#include "arena.h"
 #include "common.h"
+#include "kernel.h"
+#include "readahead.h"
+#include "stripe.h"
+#include "throttle.h"
+
+#include <linux/fs.h>
 
 uint64_t block_count;
 char* part_fn;
@@ -25,8 +32,17 @@ uint8_t* blk;
 bm_word_t* part_bm;
 int part_fh;
 uint32_t first_block;
-uint16_t block_size;
+uint32_t block_size;
+uint32_t cluster_bits;
 ext4_dump_hdr_t hdr;
+uint32_t io_size;
+uint32_t io_size_opt;
+
+// Device geometry, in bytes
+static uint32_t dev_io_min;
+static uint32_t dev_io_opt;
+static uint32_t dev_pbsz;
+static uint32_t dev_align_off;
 
 void print(char* fmt, ...)
 {
@@ -49,16 +65,93 @@ void error(char* fmt, ...)
     exit(-1);
 }
 
+uint64_t clock_ns(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
 void part_open(uint32_t write, uint32_t force_flag)
 {
     assert((write == READ) || (write = WRITE));
 
     part_fh = open(
-        part_fn, ((write == WRITE) ? (O_WRONLY | O_EXCL) :
+        part_fn, ((write == WRITE) ? (O_RDWR | O_EXCL) :
                                      (O_RDONLY | (force_flag ? 0 : O_EXCL))) |
                      O_LARGEFILE);
     if (part_fh < 0)
         error("Can't open partition %s\n%s\n", part_fn, strerror(errno));
+
+    struct stat st;
+    if (fstat(part_fh, &st))
+        error("Can't stat partition %s\n%s\n", part_fn, strerror(errno));
+    if (S_ISBLK(st.st_mode))
+    {
+        unsigned int v;
+        int off;
+        if (ioctl(part_fh, BLKIOMIN, &v) == 0)
+            dev_io_min = v;
+        if (ioctl(part_fh, BLKIOOPT, &v) == 0)
+            dev_io_opt = v;
+        if (ioctl(part_fh, BLKPBSZGET, &v) == 0)
+            dev_pbsz = v;
+        if ((ioctl(part_fh, BLKALIGNOFF, &off) == 0) && (off > 0))
+            dev_align_off = off;
+    }
+    else
+        dev_pbsz = st.st_blksize;
+}
+
+/*
+ * Pick the size of batched partition I/O once the block size is known.
+ * Batches are whole RAID stripes if a stripe fits in an I/O buffer, else
+ * whole RAID chunks, else a full buffer. The file system's RAID hints
+ * win over the device's since mkfs was told about the array. Batches
+ * never cross an io_size boundary on the device, see part_run_limit().
+ */
+void part_geometry(uint32_t raid_stride, uint32_t raid_stripe)
+{
+    assert(block_size);
+
+    uint32_t stride = raid_stride ? raid_stride * block_size : dev_io_min;
+    uint32_t stripe = raid_stripe ? raid_stripe * block_size : dev_io_opt;
+    uint32_t unit = block_size;
+    if (dev_pbsz > unit)
+        unit = dev_pbsz;
+    if (((uint32_t)block_size << cluster_bits) <= POOL_BUF_SIZE)
+    {
+        uint32_t cluster = block_size << cluster_bits;
+        if (cluster > unit)
+            unit = cluster;
+    }
+
+    if (io_size_opt)
+        io_size = io_size_opt;
+    else if (stripe && (stripe <= POOL_BUF_SIZE))
+        io_size = POOL_BUF_SIZE / stripe * stripe;
+    else if (stride && (stride <= POOL_BUF_SIZE))
+        io_size = POOL_BUF_SIZE / stride * stride;
+    else
+        io_size = POOL_BUF_SIZE;
+    io_size = io_size / unit * unit;
+    if (io_size < block_size)
+        io_size = block_size;
+
+    print("I/O size %'d bytes (device min %'d, optimal %'d, sector %'d",
+        io_size, dev_io_min, dev_io_opt, dev_pbsz);
+    if (raid_stride || raid_stripe)
+        print(", RAID stride %'d, stripe %'d blocks", raid_stride, raid_stripe);
+    print(")\n");
+}
+
+// Number of blocks a batch starting at block may span
+uint32_t part_run_limit(uint64_t block)
+{
+    assert(io_size);
+
+    uint64_t offset = block * block_size + dev_align_off;
+    return (io_size - offset % io_size) / block_size;
 }
 
 void part_seek(uint64_t offset, char* emsg)
@@ -77,27 +170,113 @@ void part_read(void* buffer, uint32_t size, char* emsg)
     assert(part_fh >= 0);
     assert(size);
 
+    uint64_t t = throttle_io_start(size);
     if (read(part_fh, buffer, size) != size)
         error("Can't read %s\n%s\n", emsg, strerror(errno));
+    throttle_io_end(t);
+}
+
+// Positional read, safe to call from several threads at once
+void part_pread(void* buffer, uint32_t size, uint64_t offset, char* emsg)
+{
+    assert(buffer);
+    assert(part_fh >= 0);
+    assert(size);
+
+    uint64_t t = throttle_io_start(size);
+    if (pread64(part_fh, buffer, size, offset) != size)
+        error("Can't read %s at 0x%'llx\n%s\n", emsg, offset, strerror(errno));
+    throttle_io_end(t);
+}
+
+/*
+ * Advance block to the next one in use before end and return how many
+ * blocks in use follow it, up to the batch limit. Returns 0 when there
+ * are none before end. Each bitmap bit covers a cluster, so whole
+ * clusters are stepped over.
+ */
+uint32_t part_next_run_to(uint64_t* block, uint64_t end)
+{
+    assert(end <= block_count);
+
+    uint64_t b = *block;
+    if (b >= end)
+        return 0;
+
+    uint64_t units = ((end - 1) >> cluster_bits) + 1;
+    uint64_t u = kern.find_set(part_bm, b >> cluster_bits, units);
+    if (u == units)
+    {
+        *block = end;
+        return 0;
+    }
+    if (u != (b >> cluster_bits))
+        b = u << cluster_bits;
+    *block = b;
+
+    uint64_t limit = b + part_run_limit(b);
+    if (limit > end)
+        limit = end;
+    uint64_t run_end =
+        kern.find_clear(part_bm, u, ((limit - 1) >> cluster_bits) + 1)
+        << cluster_bits;
+    if (run_end > limit)
+        run_end = limit;
+    return run_end - b;
+}
+
+uint32_t part_next_run(uint64_t* block)
+{
+    return part_next_run_to(block, block_count);
+}
+
+uint64_t part_used_blocks(void)
+{
+    uint64_t units = ((block_count - 1) >> cluster_bits) + 1;
+
+    // Bits past the last unit are always clear
+    uint64_t cnt =
+        kern.count(part_bm, (units + BM_WORD_BITS - 1) / BM_WORD_BITS);
+    cnt <<= cluster_bits;
+    if (get_bm_bit(part_bm, units - 1))
+        cnt -= (units << cluster_bits) - block_count;
+    return cnt;
+}
+
+void part_read_blocks(uint64_t block, uint32_t count, char* emsg)
+{
+    assert(block + count <= block_count);
+    assert(count * block_size <= POOL_BUF_SIZE);
+    assert(part_fh >= 0);
+
+    uint32_t size = count * block_size;
+    uint64_t t = throttle_io_start(size);
+    if (pread64(part_fh, blk, size, block * block_size) != size)
+        error("Can't read %s at 0x%'llx\n%s\n", emsg, block * block_size,
+            strerror(errno));
+    throttle_io_end(t);
 }
 
-void part_read_block(uint64_t block, char* emsg)
+void part_write_blocks(uint64_t block, uint32_t count, char* emsg)
 {
-    assert(block < block_count);
+    assert(block + count <= block_count);
+    assert(count * block_size <= POOL_BUF_SIZE);
     assert(part_fh >= 0);
 
-    part_seek(block * block_size, emsg);
-    part_read(blk, block_size, emsg);
+    uint32_t size = count * block_size;
+    uint64_t t = throttle_io_start(size);
+    if (pwrite64(part_fh, blk, size, block * block_size) != size)
+        error("Can't write %s at 0x%'llx\n%s\n", emsg, block * block_size,
+            strerror(errno));
+    throttle_io_end(t);
 }
 
-void part_write_block(uint64_t block, char* emsg)
+void part_sync(void)
 {
-    assert(block < block_count);
     assert(part_fh >= 0);
 
-    part_seek(block * block_size, emsg);
-    if (write(part_fh, blk, block_size) != block_size)
-        error("Can't write %s\n%s\n", emsg, strerror(errno));
+    if (fdatasync(part_fh))
+        error("Can't sync partition\n%s\n", strerror(errno));
 }
 
 void part_close(void)
@@ -132,6 +311,11 @@ void dump_open(uint32_t write, uint32_t compr_flag)
     }
     else
     {
+        if (readahead_mib)
+        {
+            readahead_open(STDIN_FILENO);
+            return;
+        }
         strcpy(mode, "rb");
         f_no = STDIN_FILENO;
     }
@@ -144,9 +328,13 @@ void dump_read(void* buffer, uint32_t size, char* emsg)
 {
     assert(buffer);
     assert(size);
-    assert(dump_fd);
+    assert(dump_fd || readahead_active);
 
-    if (gzread(dump_fd, buffer, size) != size)
+    if (stripes_active)
+        stripe_read(buffer, size, emsg);
+    else if (readahead_active)
+        readahead_read(buffer, size, emsg);
+    else if (gzread(dump_fd, buffer, size) != size)
         error("Can't read %s\n%s\n", emsg, gz_error_str());
 }
 
@@ -156,24 +344,62 @@ void dump_write(void* buffer, uint32_t size, char* emsg)
     assert(size);
     assert(dump_fd);
 
-    if (gzwrite(dump_fd, buffer, size) != size)
-        error("Can't write %s\n%s\n", emsg, gz_error_str());
+    if (stripes_active)
+        stripe_write(buffer, size, emsg);
+    else
+    {
+        uint64_t t = throttle_cpu_start();
+        if (gzwrite(dump_fd, buffer, size) != size)
+            error("Can't write %s\n%s\n", emsg, gz_error_str());
+        throttle_cpu_end(t);
+    }
 }
 
 int64_t dump_end(void)
 {
     assert(dump_fd);
 
+    int64_t stripe_bytes = stripe_cnt ? stripe_end() : 0;
+    if (gzflush(dump_fd, Z_FINISH) != Z_OK)
+        error("Can't flush backup\n%s\n", gz_error_str());
+    return stripe_cnt ? stripe_bytes : gzoffset(dump_fd);
+}
+
+// End the current gzip member and make it durable, returns the backup size
+int64_t dump_sync(void)
+{
+    assert(dump_fd);
+
     if (gzflush(dump_fd, Z_FINISH) != Z_OK)
         error("Can't flush backup\n%s\n", gz_error_str());
+    if (fsync(STDOUT_FILENO))
+        error("Can't sync backup\n%s\n", strerror(errno));
     return gzoffset(dump_fd);
 }
 
+// Cut the backup file on stdout back to offset and continue writing there
+void dump_rewind(int64_t offset)
+{
+    struct stat st;
+
+    if (fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode))
+        error("Backup output must be a file for checkpoints\n");
+    if (st.st_size < offset)
+        error("Backup file is shorter than checkpoint\n");
+    if (ftruncate(STDOUT_FILENO, offset) ||
+        (lseek64(STDOUT_FILENO, offset, SEEK_SET) != offset))
+        error("Can't rewind backup\n%s\n", strerror(errno));
+}
+
 void dump_close(void)
 {
-    assert(dump_fd);
+    assert(dump_fd || readahead_active);
 
-    if (gzclose(dump_fd) != Z_OK)
+    if (stripe_cnt)
+        stripe_close();
+    if (readahead_active)
+        readahead_close();
+    else if (gzclose(dump_fd) != Z_OK)
         error("Can't close backup\n%s\n", gz_error_str());
 }
 
@@ -30,11 +30,17 @@ along with this program; If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
 #define BACKUP_MAGIC 0xe4bae4ba
+// Backups older versions can't read: bigalloc, incremental or streamed
+#define BACKUP_MAGIC_EXT 0xe4bfe4bf
+
+#define NSEC 1000000000ull
 
 #define STRINGIZE(x) #x
 #define STRING_DEFINE(x) STRINGIZE(x)
@@ -43,11 +49,28 @@ typedef struct ext4_dump_hdr_s
 {
     uint64_t blocks;
     uint32_t block_size;
-    uint32_t magic; /* 0xe4bae4ba */
+    uint32_t magic; /* BACKUP_MAGIC if the fields below are 0 */
     uint32_t version;
-
+    uint8_t cluster_bits; /* log2 blocks per bitmap bit */
+    uint8_t flags;
+#define HDR_INCREMENTAL 0x01 /* only groups changed since the last run */
+#define HDR_STREAM 0x02      /* group records instead of one bitmap */
+#define HDR_FLAGS (HDR_INCREMENTAL | HDR_STREAM)
+    uint16_t reserved;
 } ext4_dump_hdr_t;
 
+/*
+ * Streamed backups follow the header with one record per group, then the
+ * bitmap words covering units first_unit to first_unit + units, then the
+ * data blocks of those units in use. units is 0 in the last record.
+ */
+typedef struct ext4_group_rec_s
+{
+    uint64_t first_unit;
+    uint32_t units;
+    uint32_t group;
+} ext4_group_rec_t;
+
 typedef uint32_t bm_word_t;
 #define BM_WORD_BITS (sizeof(bm_word_t) * 8)
 
@@ -57,8 +80,11 @@ extern uint8_t* blk;
 extern bm_word_t* part_bm;
 extern int part_fh;
 extern uint32_t first_block;
-extern uint16_t block_size;
+extern uint32_t block_size;
+extern uint32_t cluster_bits;
 extern ext4_dump_hdr_t hdr;
+extern uint32_t io_size;
+extern uint32_t io_size_opt;
 
 #if defined(__BYTE_ORDER) && __BYTE_ORDER == __BIG_ENDIAN ||                 \
     defined(__BIG_ENDIAN__) || defined(__ARMEB__) || defined(__THUMBEB__) || \
@@ -112,6 +138,12 @@ static inline void set_bm_bit(bm_word_t* bm, uint64_t index)
     bm[index / BM_WORD_BITS] |= 1 >> (index % BM_WORD_BITS);
 }
 
+static inline void clr_bm_bit(bm_word_t* bm, uint64_t index)
+{
+    assert(index < block_count);
+    bm[index / BM_WORD_BITS] &= ~(1 >> (index % BM_WORD_BITS));
+}
+
 #else
 
 // Little endian
@@ -145,10 +177,27 @@ static inline void set_bm_bit(bm_word_t* bm, uint64_t index)
     bm[index / BM_WORD_BITS] |= 1 << (index % BM_WORD_BITS);
 }
 
+static inline void clr_bm_bit(bm_word_t* bm, uint64_t index)
+{
+    assert(index < block_count);
+    bm[index / BM_WORD_BITS] &= ~(1 << (index % BM_WORD_BITS));
+}
+
 #endif
 
+#define BLOCK_SIZE_MIN 1024
+#define BLOCK_SIZE_MAX (64 * 1024)
+
+// Block sizes ext4 allows, any of them fits in a pool buffer
+static inline uint32_t block_size_valid(uint64_t size)
+{
+    return (size >= BLOCK_SIZE_MIN) && (size <= BLOCK_SIZE_MAX) &&
+           ((size & (size - 1)) == 0);
+}
+
 void print(char* fmt, ...);
 void error(char* fmt, ...);
+uint64_t clock_ns(clockid_t id);
 
 #define READ 0
 #define WRITE 1
@@ -156,14 +205,23 @@ void error(char* fmt, ...);
 void part_open(uint32_t write, uint32_t force_flag);
 void part_seek(uint64_t offset, char* emsg);
 void part_read(void* buffer, uint32_t size, char* emsg);
-void part_read_block(uint64_t block, char* emsg);
-void part_write_block(uint64_t block, char* emsg);
+void part_pread(void* buffer, uint32_t size, uint64_t offset, char* emsg);
+void part_geometry(uint32_t raid_stride, uint32_t raid_stripe);
+uint32_t part_run_limit(uint64_t block);
+uint32_t part_next_run_to(uint64_t* block, uint64_t end);
+uint32_t part_next_run(uint64_t* block);
+uint64_t part_used_blocks(void);
+void part_read_blocks(uint64_t block, uint32_t count, char* emsg);
+void part_write_blocks(uint64_t block, uint32_t count, char* emsg);
+void part_sync(void);
 void part_close(void);
 
 void dump_open(uint32_t write, uint32_t compr_flag);
 void dump_read(void* buffer, uint32_t size, char* emsg);
 void dump_write(void* buffer, uint32_t size, char* emsg);
 int64_t dump_end(void);
+int64_t dump_sync(void);
+void dump_rewind(int64_t offset);
 void dump_close(void);
 
 void* common_malloc(uint32_t size, char* emsg);
@@ -16,39 +16,93 @@ You should have received a copy of the GNU General Public License
 along with this program; If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "arena.h"
 #include "dump.h"
+#include "estimate.h"
+#include "kernel.h"
+#include "checkpoint.h"
+#include "scan.h"
+#include "state.h"
+#include "stripe.h"
+#include "throttle.h"
+
+#include <pthread.h>
+
+#define SCAN_THREADS_MAX 16
+// Fewer groups than this per thread are scanned faster without threads
+#define SCAN_GROUPS_MIN 64
+#define STREAM_BM_BATCH 16
+
+uint8_t stream_flag;
 
 static uint32_t part_bm_bytes;
 static uint32_t group_bm_bytes;
 static uint32_t blocks_per_group;
-static uint32_t groups;
+uint32_t clusters_per_group;
+uint64_t cluster_count;
+uint32_t groups;
 static uint16_t desc_size;
 static uint8_t feature_incompat64;
+static uint32_t raid_stride;
+static uint32_t raid_stripe;
+static uint32_t groups_per_flex;
+static uint64_t kbytes_written;
+static uint32_t write_time;
 
-static bm_word_t* group_bm;
+static ext4_group_desc_t* gds;
 
-static void part_read_group_bm(uint64_t block, char* emsg)
+typedef struct scan_s
+{
+    pthread_t thread;
+    uint32_t first;
+    uint32_t last;
+    bm_word_t* group_bm;
+    uint64_t cnt;
+} scan_t;
+
+static void or_word(uint64_t index, bm_word_t v, uint32_t shared)
 {
-    part_seek(block * block_size, emsg);
-    part_read(group_bm, group_bm_bytes, emsg);
+    if (shared)
+        __atomic_fetch_or(&part_bm[index], v, __ATOMIC_RELAXED);
+    else
+        part_bm[index] |= v;
 }
 
-
-static uint64_t copy_group_to_global_bm(uint64_t group)
+/*
+ * Bitmaps are in clusters, which are blocks unless the file system is
+ * bigalloc. Groups start at first_block, so they need not be word aligned
+ * in part_bm, and the first and last words of a group can be shared with
+ * its neighbours, which another thread may be merging. Only those words
+ * are merged atomically.
+ */
+uint64_t copy_group_to_global_bm(uint64_t group, bm_word_t* group_bm)
 {
-    uint64_t start = group * blocks_per_group;
-    uint64_t next = start + blocks_per_group;
-    if (next > block_count - first_block)
-        next = block_count - first_block;
+    uint64_t start = group * clusters_per_group;
+    uint64_t next = start + clusters_per_group;
+    if (next > cluster_count - first_block)
+        next = cluster_count - first_block;
     next -= start;
+    start += first_block;
 
+    uint64_t words = (next + BM_WORD_BITS - 1) / BM_WORD_BITS;
+    uint64_t w = start / BM_WORD_BITS;
+    uint32_t shift = start % BM_WORD_BITS;
     uint64_t cnt = 0;
-    for (uint64_t block = 0; block < next; block++)
-        if (get_bm_bit(group_bm, block))
-        {
-            set_bm_bit(part_bm, start + block + first_block);
-            cnt++;
-        }
+
+    for (uint64_t i = 0; i < words; i++)
+    {
+        bm_word_t v = le32_to_cpu(group_bm[i]);
+        // The last group's bitmap is padded with ones
+        if ((i == words - 1) && (next % BM_WORD_BITS))
+            v &= ((bm_word_t)1 << (next % BM_WORD_BITS)) - 1;
+        if (v == 0)
+            continue;
+        cnt += __builtin_popcount(v);
+        or_word(w + i, le32_to_cpu(v << shift), (i == 0) || (i + 1 >= words));
+        if (shift)
+            or_word(w + i + 1, le32_to_cpu(v >> (BM_WORD_BITS - shift)),
+                i + 2 >= words);
+    }
 
     return cnt;
 }
@@ -71,20 +125,36 @@ static void load_superblock(void)
     if ((le16_to_cpu(super->s_state) & 1) == 0)
         print("WARNING: partition was not cleanly unmounted\n");
 
-    block_size = 1024u << le32_to_cpu(super->s_log_block_size);
-    if (block_size > 64 * 1024)
+    uint32_t log_block = le32_to_cpu(super->s_log_block_size);
+    block_size = (log_block <= 6) ? 1024u << log_block : 0;
+    if (!block_size_valid(block_size))
         error("Invalid partition block size\n");
 
     blocks_per_group = le32_to_cpu(super->s_blocks_per_group);
 
+    cluster_bits = 0;
+    clusters_per_group = blocks_per_group;
+    if (super->s_feature_ro_compat & le32_to_cpu(RO_COMPAT_BIGALLOC))
+    {
+        uint32_t log_cluster = le32_to_cpu(super->s_log_cluster_size);
+        if ((log_cluster < le32_to_cpu(super->s_log_block_size)) ||
+            (log_cluster - le32_to_cpu(super->s_log_block_size) > 24))
+            error("Invalid partition cluster size\n");
+        cluster_bits = log_cluster - le32_to_cpu(super->s_log_block_size);
+        clusters_per_group = le32_to_cpu(super->s_clusters_per_group);
+        if (clusters_per_group << cluster_bits != blocks_per_group)
+            error("Invalid clusters per group\n");
+    }
+
     feature_incompat64 =
         (super->s_feature_incompat & le32_to_cpu(INCOMPAT_64BIT)) != 0;
     block_count = le32_to_cpu(super->s_blocks_count_lo);
-    if (!feature_incompat64)
+    if (feature_incompat64)
         block_count |= (uint64_t)le32_to_cpu(super->s_blocks_count_hi) << 32;
 
-    part_bm_bytes = (uint32_t)((block_count + 7) / 8);
-    group_bm_bytes = (blocks_per_group + 7) / 8;
+    cluster_count = ((block_count - 1) >> cluster_bits) + 1;
+    part_bm_bytes = (uint32_t)((cluster_count + 7) / 8);
+    group_bm_bytes = (clusters_per_group + 7) / 8;
     groups =
         (uint32_t)((block_count + blocks_per_group - 1) / blocks_per_group);
     desc_size = le16_to_cpu(super->s_desc_size);
@@ -96,81 +166,331 @@ static void load_superblock(void)
 
     first_block = le32_to_cpu(super->s_first_data_block);
 
+    groups_per_flex = 1;
+    if ((super->s_feature_incompat & le32_to_cpu(INCOMPAT_FLEX_BG)) &&
+        (super->s_log_groups_per_flex < 32))
+        groups_per_flex = 1u << super->s_log_groups_per_flex;
+
+    raid_stride = le16_to_cpu(super->s_raid_stride);
+    raid_stripe = le32_to_cpu(super->s_raid_stripe_width);
+
+    kbytes_written = le64_to_cpu(super->s_kbytes_written);
+    write_time = le32_to_cpu(super->s_wtime);
+
     free(super);
 }
 
-static uint64_t load_block_group_bitmaps(void)
+static void load_descriptors(void)
 {
-    uint32_t gd_offset = block_size;
+    uint64_t gd_offset = block_size;
     if (block_size == 1024)
         gd_offset += 1024;
 
-    print("Scanning block groups\n");
+    gds = arena_alloc((uint64_t)groups * desc_size, "group descriptors");
+    part_pread(gds, groups * desc_size, gd_offset, "group descriptors");
+}
 
-    ext4_group_desc_t* gds =
-        common_malloc(groups * desc_size, "group descriptors");
-    ext4_group_desc_t* gd = gds;
+static ext4_group_desc_t* group_desc(uint32_t group)
+{
+    return (ext4_group_desc_t*)((char*)gds + (uint64_t)group * desc_size);
+}
 
-    part_seek(gd_offset, "group descriptors");
-    part_read(gds, groups * desc_size, "group descriptors");
-    uint64_t cnt = 0;
-    for (uint32_t group = 0; group < groups; group++)
+static uint64_t group_bitmap_block(uint32_t group)
+{
+    ext4_group_desc_t* gd = group_desc(group);
+    uint64_t block_bitmap = le32_to_cpu(gd->bg_block_bitmap_lo);
+    if (desc_size > EXT4_MIN_DESC_SIZE)
+        block_bitmap |= (uint64_t)le32_to_cpu(gd->bg_block_bitmap_hi) << 32;
+    if (block_bitmap >= block_count)
+        error("Invalid block bitmap location for group %'d\n", group);
+    return block_bitmap;
+}
+
+static void* scan_groups(void* arg)
+{
+    scan_t* scan = arg;
+
+    for (uint32_t group = scan->first; group < scan->last; group++)
     {
-        uint64_t block_bitmap = le32_to_cpu(gd->bg_block_bitmap_lo);
-        if (desc_size > EXT4_MIN_DESC_SIZE)
-            block_bitmap |= (uint64_t)le32_to_cpu(gd->bg_block_bitmap_hi) << 32;
-        part_read_group_bm(block_bitmap, "block bitmap");
-        cnt += copy_group_to_global_bm(group);
-        gd = (ext4_group_desc_t*)((char*)gd + desc_size);
+        part_pread(scan->group_bm, group_bm_bytes,
+            group_bitmap_block(group) * block_size, "block bitmap");
+        scan->cnt += copy_group_to_global_bm(group, scan->group_bm);
+        if (state_fn)
+            state_group(group, group_desc(group), desc_size);
     }
+    return NULL;
+}
 
-    free(gds);
+/*
+ * Group ranges are split between threads, each with its own bitmap
+ * buffer. Small file systems are scanned on the main thread.
+ */
+static uint64_t load_block_group_bitmaps(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = groups / SCAN_GROUPS_MIN;
+    if (threads > cpus)
+        threads = cpus;
+    if (threads > SCAN_THREADS_MAX)
+        threads = SCAN_THREADS_MAX;
+    if (threads == 0)
+        threads = 1;
+
+    print("Scanning block groups");
+    if (threads > 1)
+        print(" on %d threads", threads);
+    print("\n");
+
+    // Cache line apart, so threads don't share lines
+    uint32_t bm_stride = (group_bm_bytes + 63) & ~63;
+    uint8_t* bms = arena_alloc((uint64_t)threads * bm_stride, "group bitmaps");
+
+    scan_t scans[SCAN_THREADS_MAX];
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        scans[i].first = (uint64_t)groups * i / threads;
+        scans[i].last = (uint64_t)groups * (i + 1) / threads;
+        scans[i].group_bm = (bm_word_t*)(bms + (uint64_t)i * bm_stride);
+        scans[i].cnt = 0;
+    }
+
+    if (threads == 1)
+        scan_groups(&scans[0]);
+    else
+    {
+        for (uint32_t i = 0; i < threads; i++)
+            if (pthread_create(&scans[i].thread, NULL, scan_groups, &scans[i]))
+                error("Can't start scan thread\n");
+        for (uint32_t i = 0; i < threads; i++)
+            pthread_join(scans[i].thread, NULL);
+    }
+
+    uint64_t cnt = 0;
+    for (uint32_t i = 0; i < threads; i++)
+        cnt += scans[i].cnt;
+
+    arena_free(bms);
 
     return cnt;
 }
 
-static void save_backup(uint32_t compr_flag)
+static void write_header(uint8_t flags)
 {
-    dump_open(WRITE, compr_flag);
-
     print("Writing header\n");
 
     hdr.blocks = le64_to_cpu(block_count);
     hdr.block_size = le32_to_cpu(block_size);
-    hdr.magic = le32_to_cpu(BACKUP_MAGIC);
+    hdr.magic = le32_to_cpu(
+        (flags || cluster_bits) ? BACKUP_MAGIC_EXT : BACKUP_MAGIC);
     memcpy((char*)&hdr.version, BACKUP_E4_VERSION, 3);
     ((char*)&hdr.version)[3] = 0;
+    hdr.cluster_bits = cluster_bits;
+    hdr.flags = flags;
 
     dump_write(&hdr, sizeof(hdr), "header");
+}
 
-    print("Writing partition bitmap\n");
+static void save_end(uint64_t block_cnt, uint32_t compr_flag)
+{
+    print("\n%'lld blocks dumped (%'lld bytes", block_cnt,
+        block_cnt * block_size);
+    if (compr_flag)
+    {
+        int64_t b = dump_end();
+        if (b > 0)
+            print(", compressed to %'lld bytes", b);
+    }
+    print(")\n");
 
-    dump_write(part_bm, part_bm_bytes, "bitmap");
+    if (state_fn)
+        state_save();
+}
+
+static void save_backup(uint32_t compr_flag)
+{
+    ext4_ckpt_t ckpt;
+
+    bzero(&ckpt, sizeof(ckpt));
+    if (ckpt_fn)
+    {
+        ckpt_init(CKPT_BACKUP_MAGIC, part_bm_bytes, &ckpt);
+        dump_rewind(ckpt.dump_bytes);
+    }
+
+    dump_open(WRITE, compr_flag);
+    if (stripe_cnt)
+        stripe_open(WRITE, compr_flag);
+
+    if (ckpt.next_block == 0)
+    {
+        write_header(incremental_flag ? HDR_INCREMENTAL : 0);
+
+        print("Writing partition bitmap\n");
+
+        dump_write(part_bm, part_bm_bytes, "bitmap");
+    }
 
     print("Writing data blocks\n");
 
+    uint64_t block_cnt = ckpt.block_cnt;
+    uint64_t dots = (block_cnt + 32767) >> 15;
+    uint64_t ckpt_blocks = CKPT_BYTES / block_size;
+    uint64_t block = ckpt.next_block;
+    uint32_t n;
+
+    while ((n = part_next_run(&block)) != 0)
+    {
+        part_read_blocks(block, n, "data block");
+        if (state_fn)
+            state_blocks(block, n, blk);
+        dump_write(blk, n * block_size, "block");
+        uint64_t prev_cnt = block_cnt;
+        block_cnt += n;
+        block += n;
+        for (; (dots << 15) < block_cnt; dots++)
+            print(".");
+        if (ckpt_fn && ((prev_cnt / ckpt_blocks) != (block_cnt / ckpt_blocks)))
+        {
+            ckpt.next_block = block;
+            ckpt.block_cnt = block_cnt;
+            ckpt.stream_bytes =
+                sizeof(hdr) + part_bm_bytes + block_cnt * block_size;
+            ckpt.dump_bytes = dump_sync();
+            ckpt_save(&ckpt);
+        }
+    }
+
+    if (ckpt_fn)
+    {
+        dump_sync();
+        ckpt_done();
+    }
+
+    save_end(block_cnt, compr_flag);
+}
+
+/*
+ * Read the bitmaps of up to STREAM_BM_BATCH groups at once when they sit
+ * next to each other on disk, as they do with flex_bg.
+ */
+static bm_word_t* stream_group_bm(uint32_t group, uint8_t* cache)
+{
+    static uint32_t first;
+    static uint32_t count;
+
+    if ((group < first) || (group >= first + count))
+    {
+        uint64_t b = group_bitmap_block(group);
+        for (count = 1; (count < STREAM_BM_BATCH) &&
+                        (group + count < groups) &&
+                        (group_bitmap_block(group + count) == b + count);
+             count++)
+            ;
+        first = group;
+        part_pread(cache, count * block_size, b * block_size, "block bitmap");
+    }
+    return (bm_word_t*)(cache + (uint64_t)(group - first) * block_size);
+}
+
+/*
+ * Streamed layout: no partition bitmap up front. Each group gets a record,
+ * the part_bm words covering it, and its data blocks, so data flows as
+ * soon as the group's bitmap is read. A record with no units ends it.
+ */
+static void save_stream(uint32_t compr_flag)
+{
+    dump_open(WRITE, compr_flag);
+    if (stripe_cnt)
+        stripe_open(WRITE, compr_flag);
+
+    write_header(HDR_STREAM);
+
+    print("Writing block groups\n");
+
+    uint8_t* cache =
+        arena_alloc((uint64_t)STREAM_BM_BATCH * block_size, "group bitmaps");
+    ext4_group_rec_t rec;
     uint64_t block_cnt = 0;
+    uint64_t dots = 0;
+    uint32_t n;
 
-    for (uint64_t block = 0; block < block_count; block++)
+    bzero(&rec, sizeof(rec));
+    for (uint32_t group = 0; group < groups; group++)
     {
-        if (get_bm_bit(part_bm, block))
+        copy_group_to_global_bm(group, stream_group_bm(group, cache));
+        if (group == 0)
+            set_bm_bit(part_bm, 0);
+        if (state_fn)
+            state_group(group, group_desc(group), desc_size);
+
+        // Block 0 goes with group 0 even when the first data block is 1
+        uint64_t unit = first_block + (uint64_t)group * clusters_per_group;
+        uint64_t end = unit + clusters_per_group;
+        if (group == 0)
+            unit = 0;
+        if (end > cluster_count)
+            end = cluster_count;
+        uint64_t w = unit / BM_WORD_BITS;
+        uint32_t words = (end - 1) / BM_WORD_BITS - w + 1;
+
+        rec.first_unit = le64_to_cpu(unit);
+        rec.units = le32_to_cpu(end - unit);
+        rec.group = le32_to_cpu(group);
+        dump_write(&rec, sizeof(rec), "group record");
+        dump_write(part_bm + w, words * sizeof(bm_word_t), "group bitmap");
+
+        uint64_t block = unit << cluster_bits;
+        uint64_t last = end << cluster_bits;
+        if (last > block_count)
+            last = block_count;
+        while ((n = part_next_run_to(&block, last)) != 0)
         {
-            part_read_block(block, "data block");
-            dump_write(blk, block_size, "block");
-            if ((block_cnt++ & 32767) == 0)
+            part_read_blocks(block, n, "data block");
+            if (state_fn)
+                state_blocks(block, n, blk);
+            dump_write(blk, n * block_size, "block");
+            block_cnt += n;
+            block += n;
+            for (; (dots << 15) < block_cnt; dots++)
                 print(".");
         }
     }
 
-    print("\n%'lld blocks dumped (%'lld bytes", block_cnt,
-        block_cnt * block_size);
-    if (compr_flag)
+    rec.first_unit = le64_to_cpu(cluster_count);
+    rec.units = 0;
+    rec.group = le32_to_cpu(groups);
+    dump_write(&rec, sizeof(rec), "group record");
+
+    arena_free(cache);
+
+    save_end(block_cnt, compr_flag);
+}
+
+// Scan every group bitmap first, then estimate or back up
+static void scan_then_save(uint32_t compr_lvl)
+{
+    uint64_t scan_start = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cnt = load_block_group_bitmaps();
+
+    if (!get_bm_bit(part_bm, 0))
     {
-        int64_t b = dump_end();
-        if (b > 0)
-            print(", compressed to %'lld bytes", dump_end());
+        set_bm_bit(part_bm, 0);
+        cnt++;
     }
-    print(")\n");
+
+    print("  %'lld blocks in use\n", part_used_blocks());
+
+    if (incremental_flag)
+    {
+        state_classify();
+        print("  %'lld blocks to back up\n", part_used_blocks());
+    }
+
+    if (estimate_flag)
+        estimate(compr_lvl, cnt, part_bm_bytes,
+            clock_ns(CLOCK_MONOTONIC) - scan_start);
+    else
+        save_backup(compr_lvl);
 }
 
 void dump(uint32_t compr_lvl, uint32_t force)
@@ -181,6 +501,7 @@ void dump(uint32_t compr_lvl, uint32_t force)
     print("\n");
 
     part_open(READ, force);
+    throttle_init();
 
     load_superblock();
 
@@ -188,25 +509,32 @@ void dump(uint32_t compr_lvl, uint32_t force)
         "%'d bytes per block, %'d blocks per group, %'lld blocks, %'d groups\n"
         "  %'d bytes per descriptor\n",
         block_size, blocks_per_group, block_count, groups, desc_size);
+    if (cluster_bits)
+        print("  %'d blocks per cluster\n", 1 << cluster_bits);
 
-    part_bm = common_malloc(part_bm_bytes, "partition bitmap");
-    bzero(part_bm, part_bm_bytes);
-    group_bm = common_malloc(group_bm_bytes, "group bitmap");
-    blk = common_malloc(block_size, "block");
+    part_geometry(raid_stride, raid_stripe);
+    kern_init();
 
-    uint64_t cnt = load_block_group_bitmaps();
+    pool_init(POOL_BUFS + stripe_cnt * STRIPE_DEPTH);
 
-    if (!get_bm_bit(part_bm, 0))
-    {
-        set_bm_bit(part_bm, 0);
-        cnt++;
-    }
+    part_bm = arena_alloc(part_bm_bytes, "partition bitmap");
+    blk = pool_get();
+
+    // A mounted file system only updates these on disk at commit time
+    if (state_fn)
+        state_init(groups, blocks_per_group, groups_per_flex,
+            force ? 0 : kbytes_written, force ? 0 : write_time);
+
+    load_descriptors();
 
-    print("  %'lld blocks in use\n", cnt);
+    if (stream_flag)
+        save_stream(compr_lvl);
+    else
+        scan_then_save(compr_lvl);
 
-    save_backup(compr_lvl);
+    throttle_report();
 
-    free(blk);
-    free(group_bm);
-    free(part_bm);
+    arena_free(gds);
+    pool_put(blk);
+    arena_free(part_bm);
 }
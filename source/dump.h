@@ -20,6 +20,8 @@ along with this program; If not, see <http://www.gnu.org/licenses/>.
 
 #include "common.h"
 
+extern uint8_t stream_flag;
+
 void dump(uint32_t compr_lvl, uint32_t force);
 
 typedef struct ext4_super_block_s
@@ -68,7 +70,9 @@ typedef struct ext4_super_block_s
     uint32_t s_feature_compat;          /* compatible feature set */
     /*60*/ uint32_t s_feature_incompat; /* incompatible feature set */
 #define INCOMPAT_64BIT 0x80
+#define INCOMPAT_FLEX_BG 0x200
     uint32_t s_feature_ro_compat;        /* readonly-compatible feature set */
+#define RO_COMPAT_BIGALLOC 0x200
     /*68*/ uint8_t s_uuid[16];           /* 128-bit uuid for volume */
     /*78*/ char s_volume_name[16];       /* volume name */
     /*88*/ char s_last_mounted[64];      /* directory where last mounted */
@@ -0,0 +1,195 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "estimate.h"
+#include "arena.h"
+#include "kernel.h"
+#include "stripe.h"
+
+#include <math.h>
+
+uint8_t estimate_flag;
+
+typedef struct sample_s
+{
+    double raw;
+    double comp;
+    double ns;
+} sample_t;
+
+/*
+ * Ratio estimate sum(y) / sum(x) over the samples, with the half width of
+ * its 95% confidence interval.
+ */
+static double ratio_ci(
+    sample_t* s, uint32_t n, size_t y_off, double* half)
+{
+    double sy = 0, sx = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        sy += *(double*)((char*)&s[i] + y_off);
+        sx += s[i].raw;
+    }
+    double r = sy / sx;
+
+    *half = 0;
+    if (n < 2)
+        return r;
+    double ss = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        double d = *(double*)((char*)&s[i] + y_off) - r * s[i].raw;
+        ss += d * d;
+    }
+    *half = 1.96 * sqrt(ss / (n - 1) / n) / (sx / n);
+    return r;
+}
+
+static void print_time(char* label, double ns)
+{
+    uint64_t t = (uint64_t)(ns / NSEC + 0.5);
+    print("%s%lld:%02d:%02d", label, t / 3600, (int)(t / 60 % 60),
+        (int)(t % 60));
+}
+
+/*
+ * Read and compress a stratified random sample of the runs in use, one
+ * sample in each of EST_SAMPLES equal slices of the bitmap bits set, then
+ * scale up. Sample runs are as long as a normal backup batch.
+ */
+void estimate(
+    uint32_t compr_lvl, uint64_t used, uint64_t bm_bytes, uint64_t scan_ns)
+{
+    assert(used);
+
+    uint32_t n = EST_SAMPLES;
+    if (n > used)
+        n = used;
+
+    print("Sampling %d runs\n", n);
+
+    sample_t* samples = common_malloc(n * sizeof(sample_t), "samples");
+    uLong out_size = compressBound(POOL_BUF_SIZE) + 32;
+    uint8_t* out = arena_alloc(out_size, "compression buffer");
+
+    srand48(time(NULL));
+
+    uint64_t word = 0;
+    uint64_t seen = 0;
+    uint64_t next = 0;
+    uint64_t sampled = 0;
+    uint64_t zeros = 0;
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        uint64_t rank = (uint64_t)((i + drand48()) * used / n);
+        if (rank >= used)
+            rank = used - 1;
+
+        // Ranks only go up, so the bitmap is walked once
+        uint32_t pop;
+        while (seen + (pop = __builtin_popcount(part_bm[word])) <= rank)
+        {
+            seen += pop;
+            word++;
+        }
+        uint64_t unit = word * BM_WORD_BITS;
+        for (uint64_t k = rank - seen;; unit++)
+            if (get_bm_bit(part_bm, unit) && (k-- == 0))
+                break;
+        uint64_t block = unit << cluster_bits;
+
+        // Small file systems would otherwise sample the same runs again
+        if (block < next)
+            block = next;
+        uint32_t cnt = part_next_run(&block);
+        if (cnt == 0)
+            break;
+        next = block + cnt;
+        uint32_t size = cnt * block_size;
+
+        uint64_t t0 = clock_ns(CLOCK_MONOTONIC);
+        part_read_blocks(block, cnt, "sample");
+        uint64_t t1 = clock_ns(CLOCK_MONOTONIC);
+
+        for (uint32_t j = 0; j < cnt; j++)
+            zeros += kern.zero(blk + j * block_size);
+
+        z_stream zs;
+        bzero(&zs, sizeof(zs));
+        if (deflateInit2(&zs, compr_lvl, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+            error("Can't initialize compression\n");
+        zs.next_in = blk;
+        zs.avail_in = size;
+        zs.next_out = out;
+        zs.avail_out = out_size;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+            error("Can't compress sample\n");
+        deflateEnd(&zs);
+        uint64_t t2 = clock_ns(CLOCK_MONOTONIC);
+
+        // Striped backups compress in parallel with reading
+        double read_ns = t1 - t0;
+        double comp_ns = t2 - t1;
+        if (stripe_cnt)
+        {
+            comp_ns /= stripe_cnt;
+            samples[i].ns = (read_ns > comp_ns) ? read_ns : comp_ns;
+        }
+        else
+            samples[i].ns = read_ns + comp_ns;
+        samples[i].raw = size;
+        samples[i].comp = zs.total_out;
+        sampled += size;
+    }
+
+    n = i;
+    double sample_ns = clock_ns(CLOCK_MONOTONIC) - start;
+    print("  %'lld bytes sampled in %.3f s, %.1f%% zero blocks\n", sampled,
+        sample_ns / NSEC, sampled ? 100.0 * zeros * block_size / sampled : 0.0);
+
+    double data = (double)part_used_blocks() * block_size;
+    double ratio_half, ns_half;
+    double ratio = ratio_ci(samples, n, offsetof(sample_t, comp), &ratio_half);
+    double ns = ratio_ci(samples, n, offsetof(sample_t, ns), &ns_half);
+
+    double size = sizeof(hdr) + bm_bytes + data * ratio;
+    double lo = ratio - ratio_half;
+    if (lo < 0)
+        lo = 0;
+    print("Estimated backup size %'lld bytes (%'lld - %'lld)\n",
+        (uint64_t)size, (uint64_t)(size - data * (ratio - lo)),
+        (uint64_t)(size + data * ratio_half));
+    print("  compression ratio %.3f (%.3f - %.3f)\n", ratio, lo,
+        ratio + ratio_half);
+
+    double t = scan_ns + data * ns;
+    double t_lo = t - data * ns_half;
+    if (t_lo < scan_ns)
+        t_lo = scan_ns;
+    print_time("Estimated backup time ", t);
+    print_time(" (", t_lo);
+    print_time(" - ", t + data * ns_half);
+    print(")\n  ranges are 95%% confidence intervals\n");
+
+    arena_free(out);
+    free(samples);
+}
@@ -0,0 +1,195 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "kernel.h"
+
+typedef uint64_t __attribute__((may_alias)) u64a_t;
+
+kern_t kern;
+
+#define XXH_P1 0x9e3779b185ebca87ull
+#define XXH_P2 0xc2b2ae3d27d4eb4full
+#define XXH_P3 0x165667b19e3779f9ull
+#define XXH_P4 0x85ebca77c2b2ae63ull
+
+static inline uint64_t rotl64(uint64_t x, uint32_t r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+    return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+    return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+#define ZERO_BODY(size)                     \
+    const u64a_t* w = block;                \
+    uint64_t acc = 0;                       \
+    for (uint32_t i = 0; i < (size) / 8; i++) \
+        acc |= w[i];                        \
+    return acc == 0;
+
+/*
+ * XXH64 of one block, seeded with the hash of the blocks before it. Block
+ * sizes are multiples of 32 bytes, so there is never a partial stripe.
+ */
+#define HASH_BODY(size)                                                 \
+    const u64a_t* w = block;                                            \
+    uint64_t v[4] = {                                                   \
+        seed + XXH_P1 + XXH_P2, seed + XXH_P2, seed, seed - XXH_P1};    \
+    for (uint32_t i = 0; i < (size) / 8; i += 4)                        \
+        for (uint32_t l = 0; l < 4; l++)                                \
+            v[l] = xxh_round(v[l], le64_to_cpu(w[i + l]));              \
+    uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + \
+                 rotl64(v[3], 18);                                      \
+    for (uint32_t l = 0; l < 4; l++)                                    \
+        h = xxh_merge(h, v[l]);                                         \
+    h += (size);                                                        \
+    h = (h ^ (h >> 33)) * XXH_P2;                                       \
+    h = (h ^ (h >> 29)) * XXH_P3;                                       \
+    return h ^ (h >> 32);
+
+#define FIND_BODY(invert)                                      \
+    uint64_t w = from / BM_WORD_BITS;                          \
+    bm_word_t v = (le32_to_cpu(bm[w]) ^ (invert)) &            \
+                  (~(bm_word_t)0 << (from % BM_WORD_BITS));    \
+    while (v == 0)                                             \
+    {                                                          \
+        if (++w * BM_WORD_BITS >= end)                         \
+            return end;                                        \
+        v = le32_to_cpu(bm[w]) ^ (invert);                     \
+    }                                                          \
+    uint64_t r = w * BM_WORD_BITS + __builtin_ctz(v);          \
+    return (r < end) ? r : end;
+
+#define BLOCK_KERNELS(isa, attr, sfx, size)                               \
+    attr static uint32_t zero_##isa##_##sfx(const void* block)           \
+    {                                                                     \
+        ZERO_BODY(size)                                                   \
+    }                                                                     \
+    attr static uint64_t hash_##isa##_##sfx(const void* block, uint64_t seed) \
+    {                                                                     \
+        HASH_BODY(size)                                                   \
+    }
+
+#define KERNELS(isa, attr)                                                \
+    BLOCK_KERNELS(isa, attr, 1k, 1024)                                    \
+    BLOCK_KERNELS(isa, attr, 2k, 2048)                                    \
+    BLOCK_KERNELS(isa, attr, 4k, 4096)                                    \
+    BLOCK_KERNELS(isa, attr, 64k, 65536)                                  \
+    BLOCK_KERNELS(isa, attr, any, block_size)                             \
+    attr static uint64_t count_##isa(const bm_word_t* bm, uint64_t words) \
+    {                                                                     \
+        uint64_t cnt = 0;                                                 \
+        for (uint64_t i = 0; i < words; i++)                              \
+            cnt += __builtin_popcount(bm[i]);                             \
+        return cnt;                                                       \
+    }                                                                     \
+    attr static uint64_t find_set_##isa(                                  \
+        const bm_word_t* bm, uint64_t from, uint64_t end)                 \
+    {                                                                     \
+        FIND_BODY(0)                                                      \
+    }                                                                     \
+    attr static uint64_t find_clear_##isa(                                \
+        const bm_word_t* bm, uint64_t from, uint64_t end)                 \
+    {                                                                     \
+        FIND_BODY(~(bm_word_t)0)                                          \
+    }
+
+#define KERN_ENTRY(isa, sfx, size)                                      \
+    {                                                                   \
+        #isa, size, zero_##isa##_##sfx, hash_##isa##_##sfx, count_##isa, \
+            find_set_##isa, find_clear_##isa                            \
+    }
+
+#define KERN_ROW(isa)                                                   \
+    {                                                                   \
+        KERN_ENTRY(isa, 1k, 1024), KERN_ENTRY(isa, 2k, 2048),           \
+            KERN_ENTRY(isa, 4k, 4096), KERN_ENTRY(isa, 64k, 65536),     \
+            KERN_ENTRY(isa, any, 0)                                     \
+    }
+
+#define KERN_SIZES 5
+
+#if defined(__x86_64__)
+
+KERNELS(sse2, )
+KERNELS(avx2, __attribute__((target("avx2,popcnt,bmi"))))
+KERNELS(avx512, __attribute__((target("avx512f,avx512bw,popcnt,bmi"))))
+
+static const kern_t table[][KERN_SIZES] = {
+    KERN_ROW(sse2), KERN_ROW(avx2), KERN_ROW(avx512)};
+
+static uint32_t isa_index(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return 2;
+    if (__builtin_cpu_supports("avx2"))
+        return 1;
+    return 0;
+}
+
+#else
+
+KERNELS(generic, )
+
+static const kern_t table[][KERN_SIZES] = {KERN_ROW(generic)};
+
+static uint32_t isa_index(void)
+{
+    return 0;
+}
+
+#endif
+
+static uint32_t size_index(void)
+{
+    switch (block_size)
+    {
+    case 1024:
+        return 0;
+    case 2048:
+        return 1;
+    case 4096:
+        return 2;
+    case 65536:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+void kern_init(void)
+{
+    assert(block_size);
+
+    kern = table[isa_index()][size_index()];
+}
+
+// All the variants this CPU can run, in order, for benchmarking
+uint32_t kern_variants(const kern_t** t)
+{
+    *t = &table[0][0];
+    return (isa_index() + 1) * KERN_SIZES;
+}
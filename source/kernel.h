@@ -0,0 +1,43 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+/*
+ * Per block and per bitmap kernels. Block kernels are compiled for each
+ * common block size so their loops have constant trip counts, and for
+ * each instruction set worth having. kern_init() picks one set once the
+ * block size is known.
+ */
+typedef struct kern_s
+{
+    const char* isa;
+    uint32_t block_size; // 0 when it works for any
+    uint32_t (*zero)(const void* block);
+    uint64_t (*hash)(const void* block, uint64_t seed);
+    uint64_t (*count)(const bm_word_t* bm, uint64_t words);
+    uint64_t (*find_set)(const bm_word_t* bm, uint64_t from, uint64_t end);
+    uint64_t (*find_clear)(const bm_word_t* bm, uint64_t from, uint64_t end);
+} kern_t;
+
+extern kern_t kern;
+
+void kern_init(void);
+uint32_t kern_variants(const kern_t** table);
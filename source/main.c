@@ -16,13 +16,21 @@ You should have received a copy of the GNU General Public License
 along with this program; If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "arena.h"
+#include "checkpoint.h"
 #include "dump.h"
+#include "estimate.h"
+#include "readahead.h"
 #include "restore.h"
+#include "state.h"
+#include "stripe.h"
+#include "throttle.h"
 
 uint8_t force_flag = 0;
 uint8_t compr_flag = 0;
 
 static uint8_t backup_flag = 0;
+static uint8_t readahead_opt = 0;
 static char* prog = NULL;
 
 static void help(void)
@@ -32,12 +40,38 @@ static void help(void)
         L_ENDIAN ? "little" : "big");
     if (backup_flag)
         print(
-            "%s [-c 0-9] [-f] extfs_partition_path\n"
+            "%s [-c 0-9] [-f] [-o stripe_path]... [-k checkpoint_path [-r]]\n"
+            "    [-b MiB/s] [-i IOPS] [-u CPU%%] [-a] [-H] [-m] [-z KiB] [-e]\n"
+            "    [-t state_path [-I]] [-s] extfs_partition_path\n"
             "    -c Compression level (0-none, 1-low, 9-high)\n"
-            "    -f Force backup of mounted file system (unsafe)",
+            "    -f Force backup of mounted file system (unsafe)\n"
+            "    -o Stripe backup across files, stdout gets the manifest\n"
+            "    -k Checkpoint progress to file, stdout must be a file\n"
+            "    -r Resume from checkpoint, append to backup (>>)\n"
+            "    -b Limit partition reads to MiB per second\n"
+            "    -i Limit partition reads to I/Os per second\n"
+            "    -u Limit compression to percent of a CPU\n"
+            "    -a Back off when partition latency rises\n"
+            "    -H Use huge pages for buffers\n"
+            "    -m Lock buffers in memory\n"
+            "    -z Partition I/O size in KiB (default from device geometry)\n"
+            "    -e Estimate backup size and time, from a sample\n"
+            "    -t Save per group state to file, for incremental backups\n"
+            "    -I Back up only groups changed since the state was saved\n"
+            "    -s Stream each group as it is scanned, no scan phase",
             prog);
     else
-        print("%s extfs_partition_path", prog);
+        print(
+            "%s [-o stripe_path]... [-k checkpoint_path [-r]] [-H] [-m]\n"
+            "    [-z KiB] [-B MiB] extfs_partition_path\n"
+            "    -o Stripe file, overrides the path in the manifest\n"
+            "    -k Checkpoint progress to file\n"
+            "    -r Resume from checkpoint\n"
+            "    -H Use huge pages for buffers\n"
+            "    -m Lock buffers in memory\n"
+            "    -z Partition I/O size in KiB (default from device geometry)\n"
+            "    -B Read ahead buffer for stdin in MiB, 0 for none (default %d)",
+            prog, READAHEAD_MIB);
     print("\n\n");
     exit(0);
 }
@@ -45,6 +79,19 @@ static void help(void)
 static const char* backup_name = STRING_DEFINE(BINB);
 static const char* restore_name = STRING_DEFINE(BINR);
 
+static uint64_t parse_num(char* arg, char* what, uint64_t min, uint64_t max)
+{
+    char* end;
+    errno = 0;
+    uint64_t v = strtoull(arg, &end, 10);
+    if (errno || (*end != 0) || (v < min) || (v > max))
+    {
+        print("%s must be between %'lld and %'lld\n", what, min, max);
+        help();
+    }
+    return v;
+}
+
 static void parse_args(int ac, char* av[])
 {
     int index;
@@ -61,7 +108,7 @@ static void parse_args(int ac, char* av[])
 
     opterr = 0;
 
-    while ((c = getopt(ac, av, "c:f")) != -1)
+    while ((c = getopt(ac, av, "c:fo:k:rb:i:u:aHmz:eB:t:Is")) != -1)
         switch (c)
         {
         case 'f':
@@ -75,12 +122,116 @@ static void parse_args(int ac, char* av[])
             }
             compr_flag = optarg[0] - '0';
             break;
+        case 'o':
+            if (stripe_cnt == STRIPES_MAX)
+            {
+                print("No more than %d stripes\n", STRIPES_MAX);
+                help();
+            }
+            stripe_fn[stripe_cnt++] = optarg;
+            break;
+        case 'k':
+            ckpt_fn = optarg;
+            break;
+        case 'r':
+            resume_flag = 1;
+            break;
+        case 'b':
+            throttle_bps = parse_num(optarg, "Bandwidth", 1, 1 << 20) << 20;
+            break;
+        case 'i':
+            throttle_iops = parse_num(optarg, "IOPS", 1, 10000000);
+            break;
+        case 'u':
+            throttle_cpu_pct = parse_num(optarg, "CPU percent", 1, 100);
+            break;
+        case 'a':
+            throttle_adaptive = 1;
+            break;
+        case 'H':
+            huge_flag = 1;
+            break;
+        case 'm':
+            mlock_flag = 1;
+            break;
+        case 'e':
+            estimate_flag = 1;
+            break;
+        case 'z':
+            io_size_opt =
+                parse_num(optarg, "I/O size", 1, POOL_BUF_SIZE >> 10) << 10;
+            break;
+        case 't':
+            state_fn = optarg;
+            break;
+        case 'I':
+            incremental_flag = 1;
+            break;
+        case 's':
+            stream_flag = 1;
+            break;
+        case 'B':
+            readahead_mib =
+                parse_num(optarg, "Read ahead size", 0, READAHEAD_MAX_MIB);
+            readahead_opt = 1;
+            break;
         case '?':
             print("Unknown option `-%c'.\n", optopt);
         default:
             help();
         }
 
+    if (resume_flag && !ckpt_fn)
+    {
+        print("Resume needs a checkpoint file\n");
+        help();
+    }
+
+    if (!backup_flag &&
+        (throttle_bps || throttle_iops || throttle_cpu_pct || throttle_adaptive))
+    {
+        print("Throttling is for backups only\n");
+        help();
+    }
+
+    if (backup_flag && readahead_opt)
+    {
+        print("Read ahead is for restores only\n");
+        help();
+    }
+
+    if (estimate_flag && (!backup_flag || ckpt_fn))
+    {
+        print("Estimates are for backups only, without checkpoints\n");
+        help();
+    }
+
+    if (incremental_flag && !state_fn)
+    {
+        print("Incremental backup needs a state file\n");
+        help();
+    }
+
+    if (state_fn && (!backup_flag || ckpt_fn || estimate_flag))
+    {
+        print("State files are for backups only, without checkpoints\n");
+        help();
+    }
+
+    if (stream_flag && (!backup_flag || ckpt_fn || incremental_flag ||
+                           estimate_flag))
+    {
+        print("Streaming is for backups only, without checkpoints, "
+              "incremental backups or estimates\n");
+        help();
+    }
+
+    if (ckpt_fn && stripe_cnt)
+    {
+        print("Checkpoints can't be used with stripes\n");
+        help();
+    }
+
     for (index = optind; index < ac; index++)
         if (part_fn == NULL)
             part_fn = av[index];
@@ -108,7 +259,10 @@ int main(int ac, char* av[])
     backup_flag ? dump(compr_flag, force_flag) : restore();
 
     part_close();
-    dump_close();
+    if (!estimate_flag)
+        dump_close();
+
+    arena_report();
 
     time_t elapsed = time(NULL) - start_time;
     int sec = elapsed % 60;
@@ -0,0 +1,268 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "readahead.h"
+#include "arena.h"
+
+#include <pthread.h>
+
+uint32_t readahead_mib = READAHEAD_MIB;
+uint32_t readahead_active;
+
+/*
+ * An input thread keeps a large ring of compressed bytes full from the
+ * backup stream while the main thread inflates out of it, so a slow or
+ * bursty pipe overlaps with inflate and partition writes. head and tail
+ * are running byte counts, the ring holds head - tail unconsumed bytes.
+ */
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static uint8_t* ring;
+static uint64_t ring_size;
+static uint64_t head;
+static uint64_t tail;
+static uint32_t eof;
+static int read_errno;
+static int in_fh;
+static int64_t in_base;
+
+static z_stream zs;
+static uint32_t member_end;
+static uint64_t out_pos;
+static int64_t member_in;
+static uint64_t member_out;
+static uint64_t stalled;
+
+static void unlock(void* arg)
+{
+    pthread_mutex_unlock(arg);
+}
+
+static void* reader(void* arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&lock);
+        pthread_cleanup_push(unlock, &lock);
+        while (head - tail == ring_size)
+            pthread_cond_wait(&cond, &lock);
+        pthread_cleanup_pop(1);
+
+        // Only this thread moves head, so the free space can only grow
+        uint64_t n = ring_size - (head - tail);
+        if (n > ring_size - head % ring_size)
+            n = ring_size - head % ring_size;
+        if (n > POOL_BUF_SIZE)
+            n = POOL_BUF_SIZE;
+        ssize_t r = read(in_fh, ring + head % ring_size, n);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+
+        pthread_mutex_lock(&lock);
+        if (r > 0)
+            head += r;
+        else
+        {
+            eof = 1;
+            read_errno = (r < 0) ? errno : 0;
+        }
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+        if (r <= 0)
+            return NULL;
+    }
+}
+
+static void reader_start(void)
+{
+    if (pthread_create(&thread, NULL, reader, NULL))
+        error("Can't start read ahead thread\n");
+}
+
+static void reader_stop(void)
+{
+    // The stream may not have been read to the end
+    pthread_cancel(thread);
+    pthread_join(thread, NULL);
+}
+
+void readahead_open(int f_no)
+{
+    assert(readahead_mib);
+
+    ring_size = (uint64_t)readahead_mib << 20;
+    ring = arena_alloc(ring_size, "read ahead buffer");
+    in_fh = f_no;
+
+    // Only a backup file can be seeked, see readahead_seek()
+    struct stat st;
+    in_base = -1;
+    if ((fstat(f_no, &st) == 0) && S_ISREG(st.st_mode))
+        in_base = lseek64(f_no, 0, SEEK_CUR);
+
+    bzero(&zs, sizeof(zs));
+    // Gzip or zlib header, detected per member
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+        error("Can't initialize decompression\n");
+
+    reader_start();
+    readahead_active = 1;
+}
+
+// Point zs at the next run of unconsumed input, 0 at end of stream
+static uint32_t input_wait(void)
+{
+    pthread_mutex_lock(&lock);
+    if ((head == tail) && !eof)
+    {
+        uint64_t t = clock_ns(CLOCK_MONOTONIC);
+        while ((head == tail) && !eof)
+            pthread_cond_wait(&cond, &lock);
+        stalled += clock_ns(CLOCK_MONOTONIC) - t;
+    }
+    uint64_t n = head - tail;
+    pthread_mutex_unlock(&lock);
+
+    if (n > ring_size - tail % ring_size)
+        n = ring_size - tail % ring_size;
+    if (n > UINT32_MAX)
+        n = UINT32_MAX;
+    zs.next_in = ring + tail % ring_size;
+    zs.avail_in = n;
+    return n != 0;
+}
+
+/*
+ * Whether another gzip member starts where the last one ended. As with
+ * gzread, anything else after a member is trailing data, read as the end
+ * of the stream.
+ */
+static uint32_t member_follows(void)
+{
+    static const uint8_t magic[2] = {0x1f, 0x8b};
+
+    for (uint32_t i = 0; i < sizeof(magic); i++)
+    {
+        pthread_mutex_lock(&lock);
+        while ((head - tail <= i) && !eof)
+            pthread_cond_wait(&cond, &lock);
+        uint32_t more = head - tail > i;
+        pthread_mutex_unlock(&lock);
+        if (!more || (ring[(tail + i) % ring_size] != magic[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static void input_release(uint64_t n)
+{
+    pthread_mutex_lock(&lock);
+    tail += n;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void readahead_read(void* buffer, uint32_t size, char* emsg)
+{
+    assert(buffer);
+    assert(readahead_active);
+
+    zs.next_out = buffer;
+    zs.avail_out = size;
+    while (zs.avail_out)
+    {
+        // Checkpointed backups are a series of gzip members
+        if (member_end && !member_follows())
+            error("Can't read %s\n%s\n", emsg,
+                read_errno ? strerror(read_errno) : "unexpected end of file");
+        if (member_end)
+        {
+            inflateReset(&zs);
+            member_end = 0;
+        }
+
+        if ((zs.avail_in == 0) && !input_wait())
+            error("Can't read %s\n%s\n", emsg,
+                read_errno ? strerror(read_errno) : "unexpected end of file");
+
+        uint32_t in = zs.avail_in;
+        uint32_t out = zs.avail_out;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        input_release(in - zs.avail_in);
+        out_pos += out - zs.avail_out;
+        if (ret == Z_STREAM_END)
+        {
+            member_end = 1;
+            member_in = tail;
+            member_out = out_pos;
+        }
+        else if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+            error("Can't read %s\n%s\n", emsg, zs.msg ? zs.msg : "bad data");
+    }
+}
+
+// Backup and stream offsets of the last gzip member boundary read past
+void readahead_member(int64_t* in_off, uint64_t* out_off)
+{
+    assert(readahead_active);
+
+    *in_off = member_in;
+    *out_off = member_out;
+}
+
+/*
+ * Continue reading at a gzip member boundary in_off bytes into the backup
+ * and out_off bytes into the uncompressed stream. Returns 0 if the input
+ * is a pipe, which can't be seeked.
+ */
+uint32_t readahead_seek(int64_t in_off, uint64_t out_off)
+{
+    assert(readahead_active);
+
+    if (in_base < 0)
+        return 0;
+
+    reader_stop();
+    if (lseek64(in_fh, in_base + in_off, SEEK_SET) != in_base + in_off)
+        error("Can't seek backup\n%s\n", strerror(errno));
+    head = tail = in_off;
+    eof = 0;
+    read_errno = 0;
+    inflateReset(&zs);
+    zs.avail_in = 0;
+    member_end = 0;
+    member_in = in_off;
+    out_pos = member_out = out_off;
+    reader_start();
+
+    return 1;
+}
+
+void readahead_close(void)
+{
+    assert(readahead_active);
+
+    reader_stop();
+    inflateEnd(&zs);
+    arena_free(ring);
+    readahead_active = 0;
+
+    if (stalled)
+        print("Waited %'lld ms for input\n", stalled / 1000000);
+}
@@ -0,0 +1,33 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+#define READAHEAD_MIB 32
+#define READAHEAD_MAX_MIB 4096
+
+extern uint32_t readahead_mib;
+extern uint32_t readahead_active;
+
+void readahead_open(int f_no);
+void readahead_read(void* buffer, uint32_t size, char* emsg);
+void readahead_member(int64_t* in_off, uint64_t* out_off);
+uint32_t readahead_seek(int64_t in_off, uint64_t out_off);
+void readahead_close(void);
@@ -16,7 +16,171 @@ You should have received a copy of the GNU General Public License
 along with this program; If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "arena.h"
 #include "restore.h"
+#include "checkpoint.h"
+#include "dump.h"
+#include "kernel.h"
+#include "readahead.h"
+#include "stripe.h"
+
+// Blocks per stripe aligned write window, 0 to write runs as they are
+static uint32_t stripe_blocks;
+static uint32_t window_blocks;
+
+/*
+ * Restore the blocks in use that hold the super block, before anything
+ * else, so its RAID hints can size the rest of the writes.
+ */
+static uint64_t restore_head(void)
+{
+    uint32_t head = (1024 + sizeof(ext4_super_block_t) + block_size - 1) /
+                    block_size;
+    uint32_t n;
+
+    for (n = 0; (n < head) && get_bm_bit(part_bm, n >> cluster_bits); n++)
+        ;
+    if (n)
+    {
+        dump_read(blk, n * block_size, "block");
+        part_write_blocks(0, n, "data block");
+    }
+    return n;
+}
+
+/*
+ * Size writes from the RAID hints of the super block now on the partition,
+ * restored or left by the backup an incremental one builds on. A full
+ * restore pads runs to whole stripes, see restore_run().
+ */
+static void restore_geometry(void)
+{
+    ext4_super_block_t* super =
+        common_malloc(sizeof(ext4_super_block_t), "super block");
+    uint32_t stride = 0;
+    uint32_t stripe = 0;
+
+    part_pread(super, sizeof(*super), 1024, "super block");
+    if (le16_to_cpu(super->s_magic) == 0xEF53)
+    {
+        stride = le16_to_cpu(super->s_raid_stride);
+        stripe = le32_to_cpu(super->s_raid_stripe_width);
+    }
+    free(super);
+
+    part_geometry(stride, stripe);
+
+    stripe_blocks = stripe ? stripe : stride;
+    window_blocks = io_size / block_size;
+    if (stripe_blocks)
+        window_blocks = window_blocks / stripe_blocks * stripe_blocks;
+    if ((hdr.flags & HDR_INCREMENTAL) || (stripe_blocks < 2) || !window_blocks)
+        stripe_blocks = 0;
+}
+
+/*
+ * Restore the next run of blocks in use at or past block and before end,
+ * returning 0 when there are none. On RAID the used blocks of a stripe
+ * aligned window are gathered into one write that ends on a stripe, with
+ * the free blocks between them zeroed, so the array need not read back
+ * old data to update parity. Free blocks hold nothing a full restore
+ * keeps, but an incremental one leaves unchanged blocks out of the bitmap
+ * and so writes runs as they are.
+ */
+static uint32_t restore_run(uint64_t* block, uint64_t end, uint64_t* cnt)
+{
+    uint64_t from = *block;
+    uint32_t n = part_next_run_to(block, end);
+
+    if (n && !stripe_blocks)
+    {
+        dump_read(blk, n * block_size, "block");
+        part_write_blocks(*block, n, "data block");
+        *cnt += n;
+        *block += n;
+    }
+    if (!n || !stripe_blocks)
+        return n;
+
+    uint64_t start = *block - *block % stripe_blocks;
+    uint64_t stop = start + window_blocks;
+    if (start < from)
+        start = from;
+    if (stop > end)
+        stop = end;
+    if (n > stop - *block)
+        n = stop - *block;
+
+    uint64_t b = *block;
+    uint64_t last = start;
+    do
+    {
+        bzero(blk + (last - start) * block_size, (b - last) * block_size);
+        dump_read(blk + (b - start) * block_size, n * block_size, "block");
+        *cnt += n;
+        b += n;
+        last = b;
+    } while ((n = part_next_run_to(&b, stop)) != 0);
+
+    uint64_t wend = (last + stripe_blocks - 1) / stripe_blocks * stripe_blocks;
+    if (wend > stop)
+        wend = stop;
+    bzero(blk + (last - start) * block_size, (wend - last) * block_size);
+    part_write_blocks(start, wend - start, "data block");
+    *block = stop;
+    return wend - start;
+}
+
+static void restore_stream(uint64_t units)
+{
+    ext4_group_rec_t rec;
+    uint64_t next = 0;
+    uint64_t cnt = 0;
+    uint64_t dots = 0;
+
+    part_open(WRITE, 0);
+
+    print("Restoring block groups\n");
+
+    for (;;)
+    {
+        dump_read(&rec, sizeof(rec), "group record");
+        uint64_t unit = le64_to_cpu(rec.first_unit);
+        uint64_t end = unit + le32_to_cpu(rec.units);
+        if ((unit != next) || (end > units))
+            error("Invalid group record %'d\n", le32_to_cpu(rec.group));
+        if (unit == end)
+            break;
+        next = end;
+
+        // Edge words may repeat bits of the previous group, OR them in
+        uint64_t w = unit / BM_WORD_BITS;
+        uint32_t words = (end - 1) / BM_WORD_BITS - w + 1;
+        dump_read(blk, words * sizeof(bm_word_t), "group bitmap");
+        for (uint32_t i = 0; i < words; i++)
+            part_bm[w + i] |= ((bm_word_t*)blk)[i];
+
+        uint64_t block = unit << cluster_bits;
+        uint64_t last = end << cluster_bits;
+        if (last > block_count)
+            last = block_count;
+        if (unit == 0)
+        {
+            block = cnt = restore_head();
+            restore_geometry();
+        }
+        while (restore_run(&block, last, &cnt))
+            for (; (dots << 15) < cnt; dots++)
+                print(".");
+    }
+    if (next != units)
+        error("Backup ends early\n");
+
+    print("\n%'lld blocks restored (%'lld bytes)\n", cnt, cnt * block_size);
+
+    arena_free(part_bm);
+    pool_put(blk);
+}
 
 void restore(void)
 {
@@ -28,50 +192,134 @@ void restore(void)
 
     dump_read(&hdr, sizeof(hdr), "header");
 
-    if (hdr.magic != le32_to_cpu(BACKUP_MAGIC))
+    uint32_t striped = hdr.magic == le32_to_cpu(STRIPE_MAGIC);
+    if (striped)
+        stripe_manifest();
+    else if (stripe_cnt)
+        error("Backup is not striped\n");
+
+    pool_init(POOL_BUFS + stripe_cnt * STRIPE_DEPTH);
+
+    if (striped)
+    {
+        stripe_open(READ, 0);
+        dump_read(&hdr, sizeof(hdr), "header");
+    }
+
+    uint32_t magic = le32_to_cpu(hdr.magic);
+    if ((magic != BACKUP_MAGIC) && (magic != BACKUP_MAGIC_EXT))
         error("Not dump file\n");
+    if ((magic == BACKUP_MAGIC) && (hdr.cluster_bits || hdr.flags))
+        error("Invalid header\n");
+    if (hdr.flags & ~HDR_FLAGS)
+        error("Backup needs a newer version of " STRING_DEFINE(BINR) "\n");
 
     print("Bytes per block %'d, %'lld blocks\n", hdr.block_size, hdr.blocks);
 
     block_size = le32_to_cpu(hdr.block_size);
     block_count = le64_to_cpu(hdr.blocks);
+    if (!block_size_valid(block_size))
+        error("Invalid block size\n");
+    if (block_count == 0)
+        error("Invalid block count\n");
+    cluster_bits = hdr.cluster_bits;
+    if (cluster_bits > 24)
+        error("Invalid cluster size\n");
+    if (cluster_bits)
+        print("  %'d blocks per cluster\n", 1 << cluster_bits);
+
+    if (hdr.flags & HDR_INCREMENTAL)
+        print("Incremental backup, restoring over the partition as it is\n");
 
-    uint32_t bm_bytes = (uint32_t)((block_count + 7) / 8);
+    kern_init();
 
-    part_bm = common_malloc(bm_bytes, "partition bitmap");
-    blk = common_malloc(block_size, "block");
+    uint64_t units = ((block_count - 1) >> cluster_bits) + 1;
+    uint32_t bm_bytes = (uint32_t)((units + 7) / 8);
+
+    part_bm = arena_alloc(bm_bytes, "partition bitmap");
+    blk = pool_get();
+
+    if (hdr.flags & HDR_STREAM)
+    {
+        if (ckpt_fn)
+            error("Streamed backups can't be restored with checkpoints\n");
+        restore_stream(units);
+        return;
+    }
 
     print("Reading bitmap\n");
 
     dump_read(part_bm, bm_bytes, "bitmap");
 
-    uint64_t cnt = 0;
-
-    for (uint64_t block = 0; block < block_count; block++)
-        cnt += get_bm_bit(part_bm, block);
+    uint64_t cnt = part_used_blocks();
 
     print("  %'lld blocks in use\n", cnt);
 
+    ext4_ckpt_t ckpt;
+
+    bzero(&ckpt, sizeof(ckpt));
+    if (ckpt_fn)
+        ckpt_init(CKPT_RESTORE_MAGIC, bm_bytes, &ckpt);
+
     part_open(WRITE, 0);
 
+    /*
+     * Data before the checkpoint is already on the partition. Jump to the
+     * last gzip member boundary before it when the backup is a file, and
+     * inflate past the rest.
+     */
+    uint64_t pos = sizeof(hdr) + bm_bytes;
+    uint64_t skip_to = pos + ckpt.block_cnt * block_size;
+    if ((ckpt.stream_bytes > pos) && (ckpt.stream_bytes <= skip_to) &&
+        readahead_active && readahead_seek(ckpt.dump_bytes, ckpt.stream_bytes))
+    {
+        print("Skipped %'lld backup bytes\n", ckpt.dump_bytes);
+        pos = ckpt.stream_bytes;
+    }
+    while (pos < skip_to)
+    {
+        uint64_t n = POOL_BUF_SIZE;
+        if (n > skip_to - pos)
+            n = skip_to - pos;
+        dump_read(blk, n, "block");
+        pos += n;
+    }
+    cnt = ckpt.block_cnt;
+
     print("Restoring data blocks\n");
 
-    cnt = 0;
-    for (uint64_t block = 0; block < block_count; block++)
+    uint64_t dots = (cnt + 32767) >> 15;
+    uint64_t ckpt_blocks = CKPT_BYTES / block_size;
+    uint64_t block = ckpt.next_block;
+    uint64_t prev_cnt = cnt;
+
+    if (block == 0)
+        block = cnt = restore_head();
+    restore_geometry();
+
+    while (restore_run(&block, block_count, &cnt))
     {
-        if (get_bm_bit(part_bm, block))
+        for (; (dots << 15) < cnt; dots++)
+            print(".");
+        if (ckpt_fn && ((prev_cnt / ckpt_blocks) != (cnt / ckpt_blocks)))
         {
-            dump_read(blk, block_size, "block");
-            part_write_block(block, "data block");
-            if ((cnt++ & 32767) == 0)
-            {
-                print(".");
-                fflush(stderr);
-            }
+            part_sync();
+            ckpt.next_block = block;
+            ckpt.block_cnt = cnt;
+            if (readahead_active)
+                readahead_member(&ckpt.dump_bytes, &ckpt.stream_bytes);
+            ckpt_save(&ckpt);
         }
+        prev_cnt = cnt;
+    }
+
+    if (ckpt_fn)
+    {
+        part_sync();
+        ckpt_done();
     }
     print("\n%'lld blocks restored (%'lld bytes)\n", cnt, cnt * block_size);
 
-    free(part_bm);
-    free(blk);
+    arena_free(part_bm);
+    pool_put(blk);
 }
@@ -0,0 +1,31 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+/*
+ * Block group geometry and bitmap merging from dump.c, for code that
+ * drives them directly, like the microbenchmarks.
+ */
+extern uint32_t clusters_per_group;
+extern uint64_t cluster_count;
+extern uint32_t groups;
+
+uint64_t copy_group_to_global_bm(uint64_t group, bm_word_t* group_bm);
@@ -0,0 +1,338 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "state.h"
+#include "arena.h"
+#include "kernel.h"
+
+char* state_fn;
+uint8_t incremental_flag;
+
+static ext4_state_hdr_t sh;
+static ext4_group_state_t* cur;
+static ext4_group_state_t* prev;
+static uint64_t prev_kbytes;
+static uint32_t prev_write_time;
+static uint32_t sample_stride;
+static uint32_t flex_groups;
+
+// Block 0 belongs to group 0 even when the first data block is 1
+static uint64_t group_base(uint32_t group)
+{
+    return first_block + (uint64_t)group * sh.blocks_per_group;
+}
+
+static uint64_t group_start(uint32_t group)
+{
+    return group ? group_base(group) : 0;
+}
+
+static uint64_t group_end(uint32_t group)
+{
+    uint64_t end = group_base(group + 1);
+    return (end < block_count) ? end : block_count;
+}
+
+static uint32_t group_of(uint64_t block)
+{
+    if (block < first_block)
+        return 0;
+    return (block - first_block) / sh.blocks_per_group;
+}
+
+static uint32_t is_sample(uint32_t group, uint64_t block)
+{
+    if (block < group_base(group))
+        return 0;
+    uint64_t off = block - group_base(group);
+    return ((off % sample_stride) == 0) &&
+           ((off / sample_stride) < STATE_SAMPLES);
+}
+
+static void state_swap(ext4_group_state_t* s, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        s[i].desc_crc = le32_to_cpu(s[i].desc_crc);
+        s[i].free_blocks = le32_to_cpu(s[i].free_blocks);
+        s[i].fingerprint = le64_to_cpu(s[i].fingerprint);
+        s[i].hash = le64_to_cpu(s[i].hash);
+    }
+}
+
+static void hdr_swap(ext4_state_hdr_t* h)
+{
+    h->blocks = le64_to_cpu(h->blocks);
+    h->kbytes_written = le64_to_cpu(h->kbytes_written);
+    h->groups = le32_to_cpu(h->groups);
+    h->blocks_per_group = le32_to_cpu(h->blocks_per_group);
+    h->block_size = le32_to_cpu(h->block_size);
+    h->first_block = le32_to_cpu(h->first_block);
+    h->write_time = le32_to_cpu(h->write_time);
+    h->magic = le32_to_cpu(h->magic);
+}
+
+static void state_load(void)
+{
+    ext4_state_hdr_t h;
+    uint64_t bytes = (uint64_t)sh.groups * sizeof(ext4_group_state_t);
+
+    int fh = open(state_fn, O_RDONLY);
+    if (fh < 0)
+        error("Can't open state %s\n%s\n", state_fn, strerror(errno));
+    if (read(fh, &h, sizeof(h)) != sizeof(h))
+        error("Can't read state %s\n", state_fn);
+    hdr_swap(&h);
+    if (h.magic != STATE_MAGIC)
+        error("Not state file\n");
+    if ((h.blocks != sh.blocks) || (h.groups != sh.groups) ||
+        (h.blocks_per_group != sh.blocks_per_group) ||
+        (h.block_size != sh.block_size) || (h.first_block != sh.first_block))
+        error("State is for a different partition\n");
+
+    prev = arena_alloc(bytes, "previous state");
+    if (read(fh, prev, bytes) != bytes)
+        error("Can't read state %s\n", state_fn);
+    close(fh);
+    state_swap(prev, sh.groups);
+    prev_kbytes = h.kbytes_written;
+    prev_write_time = h.write_time;
+}
+
+void state_init(uint32_t groups, uint32_t blocks_per_group,
+    uint32_t groups_per_flex, uint64_t kbytes_written, uint32_t write_time)
+{
+    assert(state_fn);
+    assert(groups && blocks_per_group && groups_per_flex);
+
+    bzero(&sh, sizeof(sh));
+    sh.blocks = block_count;
+    sh.kbytes_written = kbytes_written;
+    sh.groups = groups;
+    sh.blocks_per_group = blocks_per_group;
+    sh.block_size = block_size;
+    sh.first_block = first_block;
+    sh.write_time = write_time;
+    sh.magic = STATE_MAGIC;
+    memcpy((char*)&sh.version, BACKUP_E4_VERSION, 3);
+
+    flex_groups = groups_per_flex;
+    sample_stride = blocks_per_group / STATE_SAMPLES;
+    if (sample_stride == 0)
+        sample_stride = 1;
+
+    cur = arena_alloc((uint64_t)groups * sizeof(ext4_group_state_t), "state");
+    if (incremental_flag)
+        state_load();
+}
+
+void state_group(uint32_t group, ext4_group_desc_t* gd, uint32_t desc_size)
+{
+    assert(cur && (group < sh.groups));
+
+    uint32_t free_blocks = le16_to_cpu(gd->bg_free_blocks_count_lo);
+    if (desc_size > EXT4_MIN_DESC_SIZE)
+        free_blocks |= (uint32_t)le16_to_cpu(gd->bg_free_blocks_count_hi) << 16;
+    cur[group].desc_crc = crc32(crc32(0, NULL, 0), (uint8_t*)gd, desc_size);
+    cur[group].free_blocks = free_blocks;
+}
+
+static uint32_t block_used(uint64_t block)
+{
+    return get_bm_bit(part_bm, block >> cluster_bits);
+}
+
+static uint64_t group_fingerprint(uint32_t group)
+{
+    uint64_t fp = 0;
+    for (uint32_t i = 0; i < STATE_SAMPLES; i++)
+    {
+        uint64_t b = group_base(group) + (uint64_t)i * sample_stride;
+        if (b >= group_end(group))
+            break;
+        if (!block_used(b))
+            continue;
+        part_read_blocks(b, 1, "sample block");
+        fp = kern.hash(blk, fp);
+    }
+    return fp;
+}
+
+static uint64_t group_hash(uint32_t group)
+{
+    uint64_t end = group_end(group);
+    uint64_t b = group_start(group);
+    uint64_t h = 0;
+    uint32_t n;
+
+    while ((n = part_next_run_to(&b, end)) != 0)
+    {
+        part_read_blocks(b, n, "group block");
+        for (uint32_t i = 0; i < n; i++)
+            h = kern.hash(blk + (uint64_t)i * block_size, h);
+        b += n;
+    }
+    return h;
+}
+
+// Drop a group from the partition bitmap, so it is not backed up
+static void group_clear(uint32_t group)
+{
+    uint64_t u = group_start(group) >> cluster_bits;
+    uint64_t end = ((group_end(group) - 1) >> cluster_bits) + 1;
+
+    for (; (u < end) && (u % BM_WORD_BITS); u++)
+        clr_bm_bit(part_bm, u);
+    for (; u + BM_WORD_BITS <= end; u += BM_WORD_BITS)
+        part_bm[u / BM_WORD_BITS] = 0;
+    for (; u < end; u++)
+        clr_bm_bit(part_bm, u);
+}
+
+/*
+ * Decide which groups changed since the state was saved, cheapest test
+ * first. A different descriptor means the group changed. Otherwise, if
+ * the kernel recorded no writes since, it did not. The write counters are
+ * 0 when either run was forced on a mounted file system, where they lag.
+ * Otherwise a different sampled fingerprint is a quick sign of change, but
+ * a matching one proves nothing, so the group's blocks in use are hashed.
+ * With flex_bg a group's bitmaps and inode table live in the first group
+ * of its flex group, which is taken as changed along with it.
+ */
+void state_classify(void)
+{
+    assert(incremental_flag && prev);
+
+    uint8_t* changed = arena_alloc(sh.groups, "changed groups");
+    uint32_t by_desc = 0;
+    uint32_t by_fp = 0;
+    uint32_t by_flex = 0;
+    uint32_t by_hash = 0;
+    uint32_t hashed = 0;
+    uint32_t quiet = sh.kbytes_written && (sh.kbytes_written == prev_kbytes) &&
+                     (sh.write_time == prev_write_time);
+
+    print("Comparing %'d groups with the last backup\n", sh.groups);
+    if (quiet)
+        print("  no writes since the last backup\n");
+
+    for (uint32_t g = 0; g < sh.groups; g++)
+    {
+        if ((cur[g].desc_crc != prev[g].desc_crc) ||
+            (cur[g].free_blocks != prev[g].free_blocks))
+        {
+            changed[g] = 1;
+            by_desc++;
+        }
+        else if (!quiet && (group_fingerprint(g) != prev[g].fingerprint))
+        {
+            changed[g] = 1;
+            by_fp++;
+        }
+    }
+
+    for (uint32_t g = 0; g < sh.groups; g++)
+    {
+        uint32_t leader = g - g % flex_groups;
+        if (changed[g] && !changed[leader])
+        {
+            changed[leader] = 1;
+            by_flex++;
+        }
+    }
+
+    for (uint32_t g = 0; g < sh.groups; g++)
+    {
+        if (!changed[g] && !quiet)
+        {
+            hashed++;
+            if (group_hash(g) != prev[g].hash)
+            {
+                changed[g] = 1;
+                by_hash++;
+            }
+        }
+
+        // Changed groups are hashed again as they are backed up
+        if (!changed[g])
+        {
+            cur[g].fingerprint = prev[g].fingerprint;
+            cur[g].hash = prev[g].hash;
+            group_clear(g);
+        }
+    }
+
+    print("  %'d groups changed (%'d by descriptor, %'d by fingerprint, %'d "
+          "by flex group, %'d by hash), %'d groups hashed\n",
+        by_desc + by_fp + by_flex + by_hash, by_desc, by_fp, by_flex, by_hash,
+        hashed);
+
+    arena_free(changed);
+    arena_free(prev);
+    prev = NULL;
+}
+
+// Fold blocks being backed up into their groups' hash and fingerprint
+void state_blocks(uint64_t block, uint32_t count, uint8_t* data)
+{
+    assert(cur);
+
+    uint32_t g = group_of(block);
+    uint64_t end = group_end(g);
+    for (uint32_t i = 0; i < count; i++, block++)
+    {
+        if (block >= end)
+        {
+            g = group_of(block);
+            end = group_end(g);
+        }
+        uint8_t* p = data + (uint64_t)i * block_size;
+        cur[g].hash = kern.hash(p, cur[g].hash);
+        if (is_sample(g, block))
+            cur[g].fingerprint = kern.hash(p, cur[g].fingerprint);
+    }
+}
+
+void state_save(void)
+{
+    assert(cur);
+
+    uint64_t bytes = (uint64_t)sh.groups * sizeof(ext4_group_state_t);
+    ext4_state_hdr_t h = sh;
+    hdr_swap(&h);
+    state_swap(cur, sh.groups);
+
+    // Write aside and rename, the old state stays valid until the new one is
+    char* tmp = common_malloc(strlen(state_fn) + 5, "state");
+    sprintf(tmp, "%s.tmp", state_fn);
+    int fh = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fh < 0)
+        error("Can't create state %s\n%s\n", tmp, strerror(errno));
+    if ((write(fh, &h, sizeof(h)) != sizeof(h)) ||
+        (write(fh, cur, bytes) != bytes) || fsync(fh))
+        error("Can't write state %s\n%s\n", tmp, strerror(errno));
+    close(fh);
+    if (rename(tmp, state_fn))
+        error("Can't rename state %s\n%s\n", tmp, strerror(errno));
+    free(tmp);
+
+    arena_free(cur);
+    cur = NULL;
+
+    print("State saved to %s\n", state_fn);
+}
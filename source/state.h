@@ -0,0 +1,64 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include "dump.h"
+
+#define STATE_MAGIC 0xe4bde4bd
+// Data blocks sampled per group for the quick fingerprint
+#define STATE_SAMPLES 8
+
+/*
+ * Per group state saved after each backup, for the next incremental run.
+ * desc_crc covers the whole group descriptor, so free counts, flags and
+ * the bitmap checksums. fingerprint chains the sampled blocks in use,
+ * hash chains every block in use. Stored little-endian.
+ */
+typedef struct ext4_state_hdr_s
+{
+    uint64_t blocks;
+    uint64_t kbytes_written;
+    uint32_t groups;
+    uint32_t blocks_per_group;
+    uint32_t block_size;
+    uint32_t first_block;
+    uint32_t write_time;
+    uint32_t magic; /* 0xe4bde4bd */
+    uint32_t version;
+    uint32_t reserved;
+} ext4_state_hdr_t;
+
+typedef struct ext4_group_state_s
+{
+    uint32_t desc_crc;
+    uint32_t free_blocks;
+    uint64_t fingerprint;
+    uint64_t hash;
+} ext4_group_state_t;
+
+extern char* state_fn;
+extern uint8_t incremental_flag;
+
+void state_init(uint32_t groups, uint32_t blocks_per_group,
+    uint32_t groups_per_flex, uint64_t kbytes_written, uint32_t write_time);
+void state_group(uint32_t group, ext4_group_desc_t* gd, uint32_t desc_size);
+void state_classify(void);
+void state_blocks(uint64_t block, uint32_t count, uint8_t* data);
+void state_save(void);
@@ -0,0 +1,381 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stripe.h"
+#include "throttle.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+char* stripe_fn[STRIPES_MAX];
+uint32_t stripe_cnt;
+uint32_t stripes_active;
+
+/*
+ * Each stripe has a small ring of chunk buffers shared between the main
+ * thread and the stripe's own I/O thread. On backup the main thread fills
+ * chunks and the stripe thread compresses and writes them; on restore the
+ * stripe thread reads and inflates chunks and the main thread drains them.
+ */
+typedef struct stripe_s
+{
+    gzFile fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t* buf[STRIPE_DEPTH];
+    uint32_t len[STRIPE_DEPTH];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t count;
+    uint32_t done;
+} stripe_t;
+
+static stripe_t stripes[STRIPES_MAX];
+static uint32_t stripe_write_mode;
+static uint32_t chunk_size;
+
+// Chunk currently being filled or drained by the main thread
+static uint8_t* cur;
+static uint32_t cur_len;
+static uint32_t cur_pos;
+static uint64_t seq;
+
+// NULL once the other side is done, a reader then stops early
+static uint8_t* slot_get_empty(stripe_t* s)
+{
+    uint8_t* b = NULL;
+    pthread_mutex_lock(&s->lock);
+    while ((s->count == STRIPE_DEPTH) && !s->done)
+        pthread_cond_wait(&s->cond, &s->lock);
+    if (!s->done)
+        b = s->buf[s->head];
+    pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+static void slot_put(stripe_t* s, uint32_t len)
+{
+    pthread_mutex_lock(&s->lock);
+    s->len[s->head] = len;
+    s->head = (s->head + 1) % STRIPE_DEPTH;
+    s->count++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static uint8_t* slot_get_full(stripe_t* s, uint32_t* len)
+{
+    uint8_t* b = NULL;
+    pthread_mutex_lock(&s->lock);
+    while ((s->count == 0) && !s->done)
+        pthread_cond_wait(&s->cond, &s->lock);
+    if (s->count)
+    {
+        b = s->buf[s->tail];
+        *len = s->len[s->tail];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+static void slot_release(stripe_t* s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->tail = (s->tail + 1) % STRIPE_DEPTH;
+    s->count--;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static char* stripe_error_str(stripe_t* s)
+{
+    int eno;
+    char* emsg = (char*)gzerror(s->fd, &eno);
+    if (eno == Z_ERRNO)
+        emsg = strerror(errno);
+    return emsg;
+}
+
+static void* stripe_writer(void* arg)
+{
+    stripe_t* s = arg;
+    uint8_t* b;
+    uint32_t len;
+
+    while ((b = slot_get_full(s, &len)) != NULL)
+    {
+        uint64_t t = throttle_cpu_start();
+        if (gzwrite(s->fd, b, len) != len)
+            error("Can't write stripe %s\n%s\n", stripe_fn[s - stripes],
+                stripe_error_str(s));
+        throttle_cpu_end(t);
+        slot_release(s);
+    }
+    return NULL;
+}
+
+static void* stripe_reader(void* arg)
+{
+    stripe_t* s = arg;
+
+    for (;;)
+    {
+        uint8_t* b = slot_get_empty(s);
+        if (b == NULL)
+            break;
+        int n = gzread(s->fd, b, chunk_size);
+        if (n < 0)
+            error("Can't read stripe %s\n%s\n", stripe_fn[s - stripes],
+                stripe_error_str(s));
+        slot_put(s, n);
+        if (n < chunk_size)
+            break;
+    }
+    return NULL;
+}
+
+static void manifest_write(void)
+{
+    ext4_stripe_hdr_t sh;
+    char* paths[STRIPES_MAX];
+
+    bzero(&sh, sizeof(sh));
+    uint32_t path_bytes = 0;
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+    {
+        paths[i] = realpath(stripe_fn[i], NULL);
+        if (paths[i] == NULL)
+            error("Can't resolve stripe %s\n%s\n", stripe_fn[i],
+                strerror(errno));
+        path_bytes += strlen(paths[i]) + 1;
+    }
+
+    sh.stripes = le32_to_cpu(stripe_cnt);
+    sh.chunk_size = le32_to_cpu(chunk_size);
+    sh.path_bytes = le32_to_cpu(path_bytes);
+    sh.magic = le32_to_cpu(STRIPE_MAGIC);
+    memcpy((char*)&sh.version, BACKUP_E4_VERSION, 3);
+
+    dump_write(&sh, sizeof(sh), "stripe manifest");
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+    {
+        dump_write(paths[i], strlen(paths[i]) + 1, "stripe manifest");
+        free(paths[i]);
+    }
+}
+
+// The manifest header has already been read into hdr
+void stripe_manifest(void)
+{
+    ext4_stripe_hdr_t sh;
+
+    assert(sizeof(sh) == sizeof(hdr));
+    memcpy(&sh, &hdr, sizeof(sh));
+
+    uint32_t cnt = le32_to_cpu(sh.stripes);
+    chunk_size = le32_to_cpu(sh.chunk_size);
+    uint32_t path_bytes = le32_to_cpu(sh.path_bytes);
+    if ((cnt == 0) || (cnt > STRIPES_MAX) || (chunk_size == 0) ||
+        (chunk_size > POOL_BUF_SIZE) || (path_bytes == 0))
+        error("Invalid stripe manifest\n");
+
+    char* paths = common_malloc(path_bytes, "stripe manifest");
+    dump_read(paths, path_bytes, "stripe manifest");
+    if (paths[path_bytes - 1] != 0)
+        error("Invalid stripe manifest\n");
+
+    // Stripe paths given on the command line override the manifest
+    if (stripe_cnt)
+    {
+        if (stripe_cnt != cnt)
+            error("Backup has %d stripes, %d given\n", cnt, stripe_cnt);
+        free(paths);
+        return;
+    }
+
+    char* p = paths;
+    for (stripe_cnt = 0; stripe_cnt < cnt; stripe_cnt++)
+    {
+        if (p >= paths + path_bytes)
+            error("Invalid stripe manifest\n");
+        stripe_fn[stripe_cnt] = p;
+        p += strlen(p) + 1;
+    }
+    // paths stays allocated, stripe_fn points into it
+}
+
+void stripe_open(uint32_t write, uint32_t compr_flag)
+{
+    assert((write == READ) || (write == WRITE));
+
+    char mode[4];
+    if (write == WRITE)
+    {
+        chunk_size = STRIPE_CHUNK;
+        strcpy(mode, "wb0");
+        mode[2] = compr_flag + '0';
+    }
+    else
+        strcpy(mode, "rb");
+
+    print("%s %d stripes\n", write ? "Writing" : "Reading", stripe_cnt);
+
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+    {
+        stripe_t* s = &stripes[i];
+        s->fd = gzopen(stripe_fn[i], mode);
+        if (s->fd == NULL)
+            error("Can't open stripe %s\n%s\n", stripe_fn[i], strerror(errno));
+        gzbuffer(s->fd, chunk_size);
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        for (uint32_t j = 0; j < STRIPE_DEPTH; j++)
+            s->buf[j] = pool_get();
+    }
+
+    if (write == WRITE)
+        manifest_write();
+
+    stripe_write_mode = write;
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+        if (pthread_create(&stripes[i].thread, NULL,
+                write ? stripe_writer : stripe_reader, &stripes[i]))
+            error("Can't start stripe thread\n");
+
+    stripes_active = 1;
+}
+
+void stripe_read(void* buffer, uint32_t size, char* emsg)
+{
+    assert(buffer);
+    assert(stripes_active && !stripe_write_mode);
+
+    uint8_t* p = buffer;
+    while (size)
+    {
+        stripe_t* s = &stripes[seq % stripe_cnt];
+        if (cur == NULL)
+        {
+            cur = slot_get_full(s, &cur_len);
+            if ((cur == NULL) || (cur_len == 0))
+                error("Can't read %s\nstripe %s is short\n", emsg,
+                    stripe_fn[seq % stripe_cnt]);
+            cur_pos = 0;
+        }
+        uint32_t n = cur_len - cur_pos;
+        if (n > size)
+            n = size;
+        memcpy(p, cur + cur_pos, n);
+        p += n;
+        size -= n;
+        cur_pos += n;
+        if (cur_pos == cur_len)
+        {
+            slot_release(s);
+            cur = NULL;
+            seq++;
+        }
+    }
+}
+
+void stripe_write(void* buffer, uint32_t size, char* emsg)
+{
+    assert(buffer);
+    assert(stripes_active && stripe_write_mode);
+
+    uint8_t* p = buffer;
+    while (size)
+    {
+        stripe_t* s = &stripes[seq % stripe_cnt];
+        if (cur == NULL)
+        {
+            cur = slot_get_empty(s);
+            assert(cur);
+            cur_pos = 0;
+        }
+        uint32_t n = chunk_size - cur_pos;
+        if (n > size)
+            n = size;
+        memcpy(cur + cur_pos, p, n);
+        p += n;
+        size -= n;
+        cur_pos += n;
+        if (cur_pos == chunk_size)
+        {
+            slot_put(s, chunk_size);
+            cur = NULL;
+            seq++;
+        }
+    }
+}
+
+static void stripe_join(void)
+{
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+    {
+        stripe_t* s = &stripes[i];
+        pthread_mutex_lock(&s->lock);
+        s->done = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+    }
+    stripes_active = 0;
+}
+
+int64_t stripe_end(void)
+{
+    assert(stripe_write_mode);
+
+    if (stripes_active)
+    {
+        if (cur && cur_pos)
+            slot_put(&stripes[seq % stripe_cnt], cur_pos);
+        cur = NULL;
+        stripe_join();
+    }
+
+    int64_t total = 0;
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+    {
+        stripe_t* s = &stripes[i];
+        if (gzflush(s->fd, Z_FINISH) != Z_OK)
+            error("Can't flush stripe %s\n%s\n", stripe_fn[i],
+                stripe_error_str(s));
+        total += gzoffset(s->fd);
+    }
+    return total;
+}
+
+void stripe_close(void)
+{
+    if (stripe_write_mode)
+        stripe_end();
+    else if (stripes_active)
+        stripe_join();
+
+    for (uint32_t i = 0; i < stripe_cnt; i++)
+    {
+        stripe_t* s = &stripes[i];
+        if (gzclose(s->fd) != Z_OK)
+            error("Can't close stripe %s\n", stripe_fn[i]);
+        for (uint32_t j = 0; j < STRIPE_DEPTH; j++)
+            pool_put(s->buf[j]);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "arena.h"
+#include "common.h"
+
+#define STRIPE_MAGIC 0xe4bbe4bb
+#define STRIPES_MAX 16
+#define STRIPE_CHUNK POOL_BUF_SIZE
+#define STRIPE_DEPTH 4
+
+/*
+ * Striped backup manifest. This is what goes to stdout in place of the
+ * backup when output is striped. It has the size of ext4_dump_hdr_t with
+ * the magic at the same offset, so restore can tell them apart after
+ * reading a header. It is followed by path_bytes of NUL terminated
+ * stripe file names. Chunk n of the backup stream is in stripe n % stripes.
+ */
+typedef struct ext4_stripe_hdr_s
+{
+    uint32_t stripes;
+    uint32_t chunk_size;
+    uint32_t path_bytes;
+    uint32_t magic; /* 0xe4bbe4bb */
+    uint32_t version;
+    uint32_t reserved;
+} ext4_stripe_hdr_t;
+
+extern char* stripe_fn[STRIPES_MAX];
+extern uint32_t stripe_cnt;
+extern uint32_t stripes_active;
+
+void stripe_manifest(void);
+void stripe_open(uint32_t write, uint32_t compr_flag);
+void stripe_read(void* buffer, uint32_t size, char* emsg);
+void stripe_write(void* buffer, uint32_t size, char* emsg);
+int64_t stripe_end(void);
+void stripe_close(void);
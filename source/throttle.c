@@ -0,0 +1,183 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "throttle.h"
+
+#include <pthread.h>
+
+#define ADAPT_STEP 100000ull    // 100 us
+#define ADAPT_MAX 100000000ull  // 100 ms
+#define ADAPT_FLOOR 500000ull   // 500 us, cache hits and idle devices
+
+uint64_t throttle_bps;
+uint32_t throttle_iops;
+uint32_t throttle_cpu_pct;
+uint8_t throttle_adaptive;
+uint8_t throttle_active;
+
+typedef struct bucket_s
+{
+    double rate;  // tokens per second
+    double burst; // bucket depth
+    double tokens;
+    uint64_t last;
+} bucket_t;
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static bucket_t bw_bucket;
+static bucket_t iops_bucket;
+
+static uint64_t lat_ewma;
+static uint64_t lat_base;
+static uint64_t adapt_delay;
+
+static uint64_t cpu_t0;
+static uint64_t cpu_used;
+static uint64_t slept;
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = {ns / NSEC, ns % NSEC};
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    while (nanosleep(&ts, &ts) && (errno == EINTR))
+        ;
+    __atomic_add_fetch(
+        &slept, clock_ns(CLOCK_MONOTONIC) - start, __ATOMIC_RELAXED);
+}
+
+static void bucket_init(bucket_t* b, double rate)
+{
+    b->rate = rate;
+    b->burst = rate / 10;
+    b->tokens = b->burst;
+    b->last = clock_ns(CLOCK_MONOTONIC);
+}
+
+// Returns how long to wait before cost tokens are available
+static uint64_t bucket_take(bucket_t* b, double cost)
+{
+    if (b->rate == 0)
+        return 0;
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    b->tokens += (now - b->last) * b->rate / NSEC;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last = now;
+    b->tokens -= cost;
+    if (b->tokens >= 0)
+        return 0;
+    return (uint64_t)(-b->tokens * NSEC / b->rate);
+}
+
+void throttle_init(void)
+{
+    throttle_active =
+        throttle_bps || throttle_iops || throttle_cpu_pct || throttle_adaptive;
+    if (!throttle_active)
+        return;
+
+    bucket_init(&bw_bucket, throttle_bps);
+    bucket_init(&iops_bucket, throttle_iops);
+    cpu_t0 = clock_ns(CLOCK_MONOTONIC);
+}
+
+/*
+ * Called before each partition read or write. Waits for both token buckets
+ * and for any adaptive back off, then returns the start time.
+ */
+uint64_t throttle_io_start(uint32_t size)
+{
+    if (!throttle_active)
+        return 0;
+
+    pthread_mutex_lock(&io_lock);
+    uint64_t w1 = bucket_take(&bw_bucket, size);
+    uint64_t w2 = bucket_take(&iops_bucket, 1);
+    uint64_t wait = (w1 > w2) ? w1 : w2;
+    if (wait < adapt_delay)
+        wait = adapt_delay;
+    pthread_mutex_unlock(&io_lock);
+
+    if (wait)
+        sleep_ns(wait);
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+/*
+ * Adaptive mode watches the completion time of our own I/O. The baseline
+ * is the best smoothed latency seen, creeping up slowly so it can follow
+ * the device. Latency at twice the baseline, and above what a cache hit
+ * or an idle device would show, means the device is getting busy and the
+ * inter I/O delay doubles. It decays once latency recovers.
+ */
+void throttle_io_end(uint64_t start)
+{
+    if (!throttle_adaptive)
+        return;
+
+    uint64_t lat = clock_ns(CLOCK_MONOTONIC) - start;
+
+    pthread_mutex_lock(&io_lock);
+    lat_ewma = lat_ewma ? (lat_ewma * 7 + lat) / 8 : lat;
+    if ((lat_base == 0) || (lat_ewma < lat_base))
+        lat_base = lat_ewma;
+    else
+        lat_base += lat_base / 1024 + 1;
+    if ((lat_ewma > lat_base * 2) && (lat_ewma > ADAPT_FLOOR))
+    {
+        adapt_delay = adapt_delay * 2 + ADAPT_STEP;
+        if (adapt_delay > ADAPT_MAX)
+            adapt_delay = ADAPT_MAX;
+    }
+    else if (lat_ewma < lat_base * 3 / 2)
+        adapt_delay -= adapt_delay / 8;
+    pthread_mutex_unlock(&io_lock);
+}
+
+uint64_t throttle_cpu_start(void)
+{
+    if (!throttle_cpu_pct)
+        return 0;
+
+    return clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/*
+ * Compression CPU time from all threads is added up and compared to the
+ * wall time since start. A thread over the budget sleeps until the total
+ * is back under the cap.
+ */
+void throttle_cpu_end(uint64_t start)
+{
+    if (!throttle_cpu_pct)
+        return;
+
+    uint64_t used = __atomic_add_fetch(&cpu_used,
+        clock_ns(CLOCK_THREAD_CPUTIME_ID) - start, __ATOMIC_RELAXED);
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC) - cpu_t0;
+    uint64_t budget_wall = used * 100 / throttle_cpu_pct;
+    if (budget_wall > wall)
+        sleep_ns(budget_wall - wall);
+}
+
+void throttle_report(void)
+{
+    if (throttle_active)
+        print("Throttled for %'lld ms\n", slept / 1000000);
+}
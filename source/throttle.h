@@ -0,0 +1,34 @@
+/*
+A bare metal backup/restore utility for ext4 file systems
+Copyright (C) 2020  Jean M. Cyr
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+extern uint64_t throttle_bps;
+extern uint32_t throttle_iops;
+extern uint32_t throttle_cpu_pct;
+extern uint8_t throttle_adaptive;
+extern uint8_t throttle_active;
+
+void throttle_init(void);
+uint64_t throttle_io_start(uint32_t size);
+void throttle_io_end(uint64_t start);
+uint64_t throttle_cpu_start(void);
+void throttle_cpu_end(uint64_t start);
+void throttle_report(void);